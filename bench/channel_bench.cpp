@@ -0,0 +1,198 @@
+// Multi-producer throughput of trait::mpsc_channel against a mutex
+// guarded std::deque of TraitUPtr.
+//
+//   g++ -std=c++14 -O2 -pthread -I. -o channel_bench bench/channel_bench.cpp
+//   ./channel_bench [producer counts...]
+//
+// Every result is printed as one JSON object per line:
+//   {"benchmark": "...", "producers": N, "objects": N, "ns_per_op": ...}
+// ns_per_op is the wall time per object from the first push to the last
+// pop, the consumer pops and calls every object. "push" moves objects made
+// by trait::make, "emplace" constructs them in the slots, "push_n" moves
+// them in batches of 32 and the consumer pops with pop_n. On a single core
+// the producers and the consumer take turns, so the numbers measure the
+// cost per object rather than scaling.
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "rust_trait.h"
+
+
+template<class T>
+inline void do_not_optimize(T &&value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Work {
+    virtual unsigned work() = 0;
+};
+
+namespace shapes {
+    struct Square {
+        unsigned side;
+    };
+
+    struct Rect {
+        unsigned w;
+        unsigned h;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(Work, shapes::Square) {
+    TRAIT_FOR_CLASS_SELF;
+    unsigned work() override {
+        return self.side * self.side;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Work, shapes::Rect) {
+    TRAIT_FOR_CLASS_SELF;
+    unsigned work() override {
+        return self.w * self.h;
+    }
+};
+
+constexpr std::size_t objects = 1 << 20;
+constexpr std::size_t batch = 32;
+
+trait::TraitUPtr<Work> make_object(unsigned i) {
+    if (i & 1) {
+        return trait::make<Work, shapes::Rect>(i, 3u);
+    }
+    return trait::make<Work, shapes::Square>(i);
+}
+
+// A blocking queue as it would be written without the channel
+struct LockedQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<trait::TraitUPtr<Work>> items;
+
+    void push(trait::TraitUPtr<Work> &&item) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(std::move(item));
+        }
+        ready.notify_one();
+    }
+
+    void pop(trait::TraitUPtr<Work> &out) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] {
+            return !items.empty();
+        });
+        out = std::move(items.front());
+        items.pop_front();
+    }
+};
+
+// Runs produce(p, count) on every producer thread and consume(total) on
+// this one, which pops the objects of all producers
+template<class Produce, class Consume>
+void run(const char *name, std::size_t producers, Produce &&produce, Consume &&consume) {
+    using clock = std::chrono::steady_clock;
+    std::size_t total = objects / producers * producers;
+    auto best = std::chrono::duration<double, std::nano>::max();
+    for (int round = 0; round < 3; round++) {
+        auto start = clock::now();
+        std::vector<std::thread> threads;
+        for (std::size_t p = 0; p < producers; p++) {
+            threads.emplace_back([&, p] {
+                produce(static_cast<unsigned>(p), objects / producers);
+            });
+        }
+        unsigned long long sum = consume(total);
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        best = std::min(best, std::chrono::duration<double, std::nano>(clock::now() - start));
+        do_not_optimize(sum);
+    }
+    std::printf("{\"benchmark\": \"%s\", \"producers\": %zu, \"objects\": %zu, \"ns_per_op\": %.3f}\n",
+                name, producers, total, best.count() / total);
+    std::fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::size_t> counts;
+    for (int i = 1; i < argc; i++) {
+        counts.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+    if (counts.empty()) {
+        counts = {1, 2, 4, 8};
+    }
+    for (std::size_t producers : counts) {
+        LockedQueue queue;
+        run("mutex_deque", producers, [&](unsigned p, std::size_t count) {
+            for (std::size_t i = 0; i < count; i++) {
+                queue.push(make_object(p + static_cast<unsigned>(i)));
+            }
+        }, [&](std::size_t total) {
+            unsigned long long sum = 0;
+            trait::TraitUPtr<Work> item{nullptr, nullptr};
+            for (std::size_t i = 0; i < total; i++) {
+                queue.pop(item);
+                sum += item->work();
+                item.reset();
+            }
+            return sum;
+        });
+        trait::mpsc_channel<Work> channel(1024);
+        auto consume = [&](std::size_t total) {
+            unsigned long long sum = 0;
+            trait::TraitUPtr<Work> item{nullptr, nullptr};
+            for (std::size_t i = 0; i < total; i++) {
+                channel.pop(item);
+                sum += item->work();
+                item.reset();
+            }
+            return sum;
+        };
+        run("channel_push", producers, [&](unsigned p, std::size_t count) {
+            for (std::size_t i = 0; i < count; i++) {
+                channel.push(make_object(p + static_cast<unsigned>(i)));
+            }
+        }, consume);
+        run("channel_emplace", producers, [&](unsigned p, std::size_t count) {
+            for (std::size_t i = 0; i < count; i++) {
+                unsigned v = p + static_cast<unsigned>(i);
+                if (v & 1) {
+                    channel.emplace<shapes::Rect>(v, 3u);
+                } else {
+                    channel.emplace<shapes::Square>(v);
+                }
+            }
+        }, consume);
+        run("channel_push_n", producers, [&](unsigned p, std::size_t count) {
+            std::vector<trait::TraitUPtr<Work>> items;
+            items.reserve(batch);
+            for (std::size_t i = 0; i < count; i++) {
+                items.push_back(make_object(p + static_cast<unsigned>(i)));
+                if (items.size() == batch) {
+                    channel.push_n(items.begin(), items.size());
+                    items.clear();
+                }
+            }
+            channel.push_n(items.begin(), items.size());
+        }, [&](std::size_t total) {
+            unsigned long long sum = 0;
+            std::vector<trait::TraitUPtr<Work>> items;
+            items.reserve(batch);
+            while (total) {
+                total -= channel.pop_n(items, std::min(batch, total));
+                for (auto &item : items) {
+                    sum += item->work();
+                }
+                items.clear();
+            }
+            return sum;
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,179 @@
+// Memory and traversal throughput of TraitRefCompact against TraitRef
+// for the edges of a graph of heterogeneous nodes.
+//
+//   g++ -std=c++14 -O2 -I. -o compact_bench bench/compact_bench.cpp
+//   ./compact_bench [node counts...]
+//
+// Every result is printed as one JSON object per line:
+//   {"benchmark": "...", "nodes": N, "edges": N, "edge_bytes": N, "ns_per_edge": ...}
+// Every node has four outgoing edges, a traversal calls a trait method on
+// the target of each edge. "sorted" stores the edges in the order of their
+// targets, so the edge array is streamed and its size dominates; "random"
+// points them anywhere, so the loads of the targets dominate.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "rust_trait.h"
+
+
+template<class T>
+inline void do_not_optimize(T &&value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Value {
+    virtual int value() = 0;
+};
+
+namespace shapes {
+    struct Square {
+        int side;
+    };
+
+    struct Rect {
+        int w;
+        int h;
+    };
+
+    struct Tri {
+        int b;
+        int h;
+    };
+
+    struct Line {
+        int len;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Square) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.side * self.side;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Rect) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.w * self.h;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Tri) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.b * self.h / 2;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Line) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.len;
+    }
+};
+
+constexpr std::size_t degree = 4;
+
+template<class Fn>
+void run(const char *name, std::size_t nodes, std::size_t edges, std::size_t edge_bytes, Fn &&fn) {
+    using clock = std::chrono::steady_clock;
+    fn();
+    std::size_t iterations = 0;
+    auto best = std::chrono::duration<double, std::nano>::max();
+    auto deadline = clock::now() + std::chrono::milliseconds(200);
+    do {
+        auto start = clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double, std::nano>(clock::now() - start));
+        iterations++;
+    } while (clock::now() < deadline || iterations < 3);
+    std::printf("{\"benchmark\": \"%s\", \"nodes\": %zu, \"edges\": %zu, \"edge_bytes\": %zu, \"ns_per_edge\": %.3f}\n",
+                name, nodes, edges, edge_bytes, best.count() / edges);
+    std::fflush(stdout);
+}
+
+template<class Ref>
+void traverse(const char *name, std::size_t nodes, std::vector<Ref> &edges) {
+    run(name, nodes, edges.size(), edges.size() * sizeof(Ref), [&] {
+        int sum = 0;
+        for (auto &e : edges) {
+            sum += e->value();
+        }
+        int result = sum;
+        do_not_optimize(result);
+    });
+}
+
+void bench(std::size_t nodes) {
+    std::mt19937 rng(2024);
+    std::vector<shapes::Square> squares;
+    std::vector<shapes::Rect> rects;
+    std::vector<shapes::Tri> tris;
+    std::vector<shapes::Line> lines;
+    squares.reserve(nodes);
+    rects.reserve(nodes);
+    tris.reserve(nodes);
+    lines.reserve(nodes);
+    std::vector<trait::TraitRef<Value>> targets;
+    targets.reserve(nodes);
+    for (std::size_t i = 0; i < nodes; i++) {
+        int v = static_cast<int>(i % 97);
+        switch (rng() % 4) {
+        case 0:
+            squares.push_back(shapes::Square{v});
+            targets.emplace_back(squares.back());
+            break;
+        case 1:
+            rects.push_back(shapes::Rect{v, 3});
+            targets.emplace_back(rects.back());
+            break;
+        case 2:
+            tris.push_back(shapes::Tri{v, 4});
+            targets.emplace_back(tris.back());
+            break;
+        default:
+            lines.push_back(shapes::Line{v});
+            targets.emplace_back(lines.back());
+            break;
+        }
+    }
+    std::vector<std::size_t> order(nodes * degree);
+    for (auto &o : order) {
+        o = rng() % nodes;
+    }
+    for (int sorted = 1; sorted >= 0; sorted--) {
+        if (sorted) {
+            std::sort(order.begin(), order.end());
+        } else {
+            std::shuffle(order.begin(), order.end(), rng);
+        }
+        std::vector<trait::TraitRef<Value>> refs;
+        std::vector<trait::TraitRefCompact<Value>> compact;
+        refs.reserve(order.size());
+        compact.reserve(order.size());
+        for (std::size_t o : order) {
+            refs.emplace_back(targets[o]);
+            compact.emplace_back(targets[o]);
+        }
+        traverse(sorted ? "sorted_traitref" : "random_traitref", nodes, refs);
+        traverse(sorted ? "sorted_traitref_compact" : "random_traitref_compact", nodes, compact);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::size_t> counts;
+    for (int i = 1; i < argc; i++) {
+        counts.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+    if (counts.empty()) {
+        counts = {1 << 10, 1 << 16, 1 << 20};
+    }
+    for (std::size_t nodes : counts) {
+        bench(nodes);
+    }
+    return 0;
+}
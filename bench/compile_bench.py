@@ -0,0 +1,224 @@
+#!/usr/bin/env python3
+"""Compile-time benchmark for trait resolution.
+
+Generates sources that scale the number of traits, impls, trait bounds of a
+blanket impl and the recursion depth of a generic impl chain, compiles each
+one with every available compiler and prints one JSON object per compile:
+
+    python3 bench/compile_bench.py
+    python3 bench/compile_bench.py --compilers g++ --sweep traits=8,32 --sweep depth=16
+
+Recorded values are wall time, peak compiler RSS and, when the compiler can
+report it, the number of template instantiations (clang, from -ftime-trace)
+or the time spent in template instantiation (gcc, from -ftime-report).
+"""
+import argparse
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+DEFAULTS = {'traits': 8, 'impls': 8, 'bounds': 2, 'depth': 8}
+
+DEFAULT_SWEEP = {
+    'traits': [4, 16, 64],
+    'impls': [4, 16, 64],
+    'bounds': [1, 4, 8],
+    'depth': [8, 32, 64],
+}
+
+
+def generate(traits, impls, bounds, depth):
+    out = ['#include "rust_trait.h"', '']
+    for t in range(traits):
+        out.append('struct Trait%d {\n    virtual int m%d() = 0;\n};' % (t, t))
+    for i in range(impls):
+        out.append('struct Type%d {\n    int v = %d;\n};' % (i, i))
+        for t in range(traits):
+            out.append('IMPL_TRAIT_FOR_CLASS(Trait%d, Type%d) {\n'
+                       '    TRAIT_FOR_CLASS_SELF;\n'
+                       '    int m%d() override {\n        return self.v + %d;\n    }\n};' % (t, i, t, t))
+    if bounds:
+        bound_list = ', '.join('Trait%d' % t for t in range(min(bounds, traits)))
+        out.append('struct Blanket {\n    virtual int blanket() = 0;\n};')
+        out.append('IMPL_TRAIT_FOR_TRAIT(Blanket, %s) {\n'
+                   '    TRAIT_FOR_TRAIT_SELF(Blanket);\n'
+                   '    int blanket() override {\n'
+                   '        return trait::to_trait<Trait0>(self).m0();\n    }\n};' % bound_list)
+    out.append('''
+struct Zero {};
+template<class Inner>
+struct Succ {};
+template<int N>
+struct Nat {
+    using type = Succ<typename Nat<N - 1>::type>;
+};
+template<>
+struct Nat<0> {
+    using type = Zero;
+};
+struct Even {
+    virtual int parity() = 0;
+};
+struct Odd {
+    virtual int parity() = 0;
+};
+IMPL_TRAIT_FOR_CLASS(Even, Zero) {
+    TRAIT_FOR_CLASS_SELF;
+    int parity() override {
+        return 0;
+    }
+};
+IMPL_TRAIT_FOR_GENERIC(class Inner, Even, Succ<Inner>, TRAIT_BOUND(Inner, Odd)) {
+    TRAIT_FOR_GENERIC_SELF(Even, Succ<Inner>);
+    int parity() override {
+        return 0;
+    }
+};
+IMPL_TRAIT_FOR_GENERIC(class Inner, Odd, Succ<Inner>, TRAIT_BOUND(Inner, Even)) {
+    TRAIT_FOR_GENERIC_SELF(Odd, Succ<Inner>);
+    int parity() override {
+        return 1;
+    }
+};
+''')
+    out.append('static_assert(trait::is_trait<Nat<%d>::type, %s>, "parity");' % (depth, 'Even' if depth % 2 == 0 else 'Odd'))
+    out.append('\nint main() {\n    int sum = 0;')
+    for i in range(impls):
+        out.append('    {\n        Type%d value;' % i)
+        for t in range(traits):
+            out.append('        sum += trait::to_trait<Trait%d>(value).m%d();' % (t, t))
+        out.append('        trait::TraitRef<Trait0> ref = value;\n        sum += ref->m0();')
+        if bounds:
+            out.append('        sum += trait::to_trait<Blanket>(value).blanket();')
+        out.append('    }')
+    out.append('    return sum & 1;\n}\n')
+    return '\n'.join(out)
+
+
+def run(cmd, cwd):
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, cwd=cwd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    _, stderr = proc.communicate()
+    elapsed = time.perf_counter() - start
+    return proc.returncode, elapsed, stderr.decode(errors='replace')
+
+
+def peak_rss_kb(cmd, cwd):
+    """Runs cmd once more under wait4 to read its own peak RSS."""
+    pid = os.fork()
+    if pid == 0:
+        os.chdir(cwd)
+        devnull = os.open(os.devnull, os.O_WRONLY)
+        os.dup2(devnull, 1)
+        os.dup2(devnull, 2)
+        try:
+            os.execvp(cmd[0], cmd)
+        finally:
+            os._exit(127)
+    _, _, usage = os.wait4(pid, 0)
+    return usage.ru_maxrss
+
+
+def is_clang(compiler):
+    try:
+        version = subprocess.run([compiler, '--version'], stdout=subprocess.PIPE).stdout.decode()
+    except OSError:
+        return False
+    return 'clang' in version
+
+
+def compile_once(compiler, std, opt, defines, workdir, source):
+    obj = os.path.join(workdir, 'bench.o')
+    cmd = [compiler, '-std=' + std, opt] + ['-D' + d for d in defines] + ['-I', ROOT, '-c', source, '-o', obj]
+    clang = is_clang(compiler)
+    if clang:
+        cmd += ['-ftime-trace', '-ftime-trace-granularity=0']
+    else:
+        cmd += ['-ftime-report']
+    code, elapsed, stderr = run(cmd, workdir)
+    result = {'ok': code == 0, 'seconds': round(elapsed, 4)}
+    if code != 0:
+        result['error'] = stderr.strip().splitlines()[-1] if stderr.strip() else 'compiler failed'
+        return result
+    result['peak_rss_kb'] = peak_rss_kb(cmd, workdir)
+    result['instantiations'] = None
+    result['instantiation_seconds'] = None
+    if clang:
+        trace = os.path.join(workdir, 'bench.json')
+        if os.path.exists(trace):
+            with open(trace) as f:
+                events = json.load(f).get('traceEvents', [])
+            result['instantiations'] = sum(1 for e in events
+                                           if e.get('name') in ('InstantiateClass', 'InstantiateFunction'))
+    else:
+        match = re.search(r'template instantiation\s*:\s*([0-9.]+)\s*\(', stderr)
+        if match:
+            result['instantiation_seconds'] = float(match.group(1))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--compilers', default='g++,clang++',
+                        help='comma separated compilers, missing ones are skipped')
+    parser.add_argument('--std', default='c++14')
+    parser.add_argument('--opt', default='-O2')
+    parser.add_argument('--define', action='append', default=[],
+                        help='macro passed as -D, e.g. --define TRAIT_BACKEND=14')
+    parser.add_argument('--repeat', type=int, default=1, help='keep the fastest of N compiles')
+    parser.add_argument('--sweep', action='append', default=[],
+                        help='parameter=v1,v2,... (traits, impls, bounds, depth); '
+                             'the other parameters keep their defaults')
+    parser.add_argument('--keep', help='directory to keep the generated sources in')
+    args = parser.parse_args()
+
+    sweep = {}
+    for item in args.sweep:
+        name, _, values = item.partition('=')
+        if name not in DEFAULTS:
+            parser.error('unknown parameter ' + name)
+        sweep[name] = [int(v) for v in values.split(',')]
+    if not sweep:
+        sweep = DEFAULT_SWEEP
+
+    compilers = [c for c in args.compilers.split(',') if shutil.which(c)]
+    if not compilers:
+        parser.error('no compiler found')
+
+    workdir = args.keep or tempfile.mkdtemp(prefix='trait_compile_bench_')
+    os.makedirs(workdir, exist_ok=True)
+    try:
+        for name, values in sweep.items():
+            for value in values:
+                params = dict(DEFAULTS)
+                params[name] = value
+                source = os.path.join(workdir, 'bench_%s_%d.cpp' % (name, value))
+                with open(source, 'w') as f:
+                    f.write(generate(**params))
+                for compiler in compilers:
+                    best = None
+                    for _ in range(args.repeat):
+                        result = compile_once(compiler, args.std, args.opt, args.define, workdir, source)
+                        if best is None or (result['ok'] and result['seconds'] < best['seconds']):
+                            best = result
+                    record = {'compiler': compiler, 'std': args.std, 'sweep': name}
+                    if args.define:
+                        record['defines'] = args.define
+                    record.update(params)
+                    record.update(best)
+                    print(json.dumps(record), flush=True)
+    finally:
+        if not args.keep:
+            shutil.rmtree(workdir, ignore_errors=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,752 @@
+// Runtime dispatch micro-benchmarks.
+//
+//   g++ -std=c++14 -O2 -I. -o dispatch_bench bench/dispatch_bench.cpp
+//   ./dispatch_bench [object counts...]
+//
+// Every result is printed as one JSON object per line:
+//   {"benchmark": "...", "objects": N, "ns_per_op": ..., "iterations": ...}
+// The default object counts keep the working set in L1, in L2/L3 and in
+// main memory respectively.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+#include "rust_trait.h"
+
+
+template<class T>
+inline void do_not_optimize(T &&value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Value {
+    virtual int value() = 0;
+};
+
+struct Doubled {
+    virtual int doubled() = 0;
+};
+
+TRAIT_DYN(Value, TRAIT_DYN_METHOD(&Value::value));
+
+namespace shapes {
+    struct Square {
+        int side;
+    };
+
+    struct Rect {
+        int w;
+        int h;
+    };
+
+    struct Tri {
+        int b;
+        int h;
+    };
+
+    struct Line {
+        int len;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Square) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.side * self.side;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Rect) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.w * self.h;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Tri) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.b * self.h / 2;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Line) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.len;
+    }
+};
+
+IMPL_TRAIT_FOR_TRAIT(Doubled, Value) {
+    TRAIT_FOR_TRAIT_SELF(Doubled);
+    int doubled() override {
+        return trait::to_trait<Value>(self).value() * 2;
+    }
+};
+
+// Streams the ints of [cur, end)
+struct Scan {
+    const int *cur;
+    const int *end;
+};
+
+IMPL_TRAIT_FOR_CLASS(trait::Iterator<int>, Scan) {
+    TRAIT_FOR_CLASS_SELF;
+    bool next(int &out) override {
+        if (self.cur == self.end) {
+            return false;
+        }
+        out = *self.cur++;
+        return true;
+    }
+};
+
+// The same stream copying whole chunks at once
+struct BulkScan {
+    const int *cur;
+    const int *end;
+};
+
+IMPL_TRAIT_FOR_CLASS(trait::Iterator<int>, BulkScan) {
+    TRAIT_FOR_CLASS_SELF;
+    bool next(int &out) override {
+        if (self.cur == self.end) {
+            return false;
+        }
+        out = *self.cur++;
+        return true;
+    }
+    std::size_t next_chunk(int *out, std::size_t count) override {
+        std::size_t n = std::min(count, static_cast<std::size_t>(self.end - self.cur));
+        std::copy(self.cur, self.cur + n, out);
+        self.cur += n;
+        return n;
+    }
+};
+
+// Plain virtual inheritance baseline
+namespace virt {
+    struct Base {
+        virtual ~Base() = default;
+        virtual int value() = 0;
+    };
+
+    struct Square final : public Base {
+        int side;
+        explicit Square(int side_): side(side_) {}
+        int value() override {
+            return side * side;
+        }
+    };
+
+    struct Rect final : public Base {
+        int w;
+        int h;
+        Rect(int w_, int h_): w(w_), h(h_) {}
+        int value() override {
+            return w * h;
+        }
+    };
+
+    struct Tri final : public Base {
+        int b;
+        int h;
+        Tri(int b_, int h_): b(b_), h(h_) {}
+        int value() override {
+            return b * h / 2;
+        }
+    };
+
+    struct Line final : public Base {
+        int len;
+        explicit Line(int len_): len(len_) {}
+        int value() override {
+            return len;
+        }
+    };
+}
+
+using ShapeEnum = trait::TraitEnum<Value, shapes::Square, shapes::Rect, shapes::Tri, shapes::Line>;
+using ShapeVec = trait::TraitVec<Value, shapes::Square, shapes::Rect, shapes::Tri, shapes::Line>;
+
+// The same shuffled sequence of objects in every representation
+struct Workload {
+    std::vector<int> kinds;
+    std::vector<shapes::Square> squares;
+    std::vector<shapes::Rect> rects;
+    std::vector<shapes::Tri> tris;
+    std::vector<shapes::Line> lines;
+    std::vector<trait::TraitRef<Value>> refs;
+    std::vector<trait::Dyn<Value>> dyns;
+
+    explicit Workload(std::size_t count) {
+        std::mt19937 rng(12345);
+        kinds.resize(count);
+        for (std::size_t i = 0; i < count; i++) {
+            kinds[i] = static_cast<int>(rng() % 4);
+        }
+        squares.reserve(count);
+        rects.reserve(count);
+        tris.reserve(count);
+        lines.reserve(count);
+        for (std::size_t i = 0; i < count; i++) {
+            int v = static_cast<int>(i % 97);
+            switch (kinds[i]) {
+            case 0:
+                squares.push_back(shapes::Square{v});
+                refs.emplace_back(squares.back());
+                dyns.emplace_back(squares.back());
+                break;
+            case 1:
+                rects.push_back(shapes::Rect{v, 3});
+                refs.emplace_back(rects.back());
+                dyns.emplace_back(rects.back());
+                break;
+            case 2:
+                tris.push_back(shapes::Tri{v, 4});
+                refs.emplace_back(tris.back());
+                dyns.emplace_back(tris.back());
+                break;
+            default:
+                lines.push_back(shapes::Line{v});
+                refs.emplace_back(lines.back());
+                dyns.emplace_back(lines.back());
+                break;
+            }
+        }
+    }
+
+    template<class Fn>
+    void for_each_kind(Fn &&fn) {
+        std::size_t s = 0, r = 0, t = 0, l = 0;
+        for (int kind : kinds) {
+            int v;
+            switch (kind) {
+            case 0:
+                v = squares[s++].side;
+                fn(kind, v, 0);
+                break;
+            case 1:
+                v = rects[r++].w;
+                fn(kind, v, 3);
+                break;
+            case 2:
+                v = tris[t++].b;
+                fn(kind, v, 4);
+                break;
+            default:
+                v = lines[l++].len;
+                fn(kind, v, 0);
+                break;
+            }
+        }
+    }
+};
+
+template<class Fn>
+void run(const char *name, std::size_t objects, Fn &&fn) {
+    using clock = std::chrono::steady_clock;
+    fn();
+    std::size_t iterations = 0;
+    auto best = std::chrono::duration<double, std::nano>::max();
+    auto deadline = clock::now() + std::chrono::milliseconds(200);
+    do {
+        auto start = clock::now();
+        fn();
+        auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start);
+        best = std::min(best, elapsed);
+        iterations++;
+    } while (clock::now() < deadline || iterations < 3);
+    // An empty workload reports 0 rather than dividing by zero
+    double ns_per_op = objects ? best.count() / objects : 0.0;
+    std::printf("{\"benchmark\": \"%s\", \"objects\": %zu, \"ns_per_op\": %.3f, \"iterations\": %zu}\n",
+                name, objects, ns_per_op, iterations);
+    std::fflush(stdout);
+}
+
+__attribute__((noinline)) int call_ref(trait::TraitRef<Value> ref) {
+    return ref->value();
+}
+
+void bench(std::size_t count) {
+    Workload w(count);
+
+    // Monomorphic paths over a single concrete type
+    {
+        std::vector<shapes::Square> squares(count);
+        for (std::size_t i = 0; i < count; i++) {
+            squares[i].side = static_cast<int>(i % 97);
+        }
+        run("direct_call", count, [&] {
+            int sum = 0;
+            for (auto &s : squares) {
+                sum += s.side * s.side;
+            }
+            do_not_optimize(sum);
+        });
+        run("to_trait_static", count, [&] {
+            int sum = 0;
+            for (auto &s : squares) {
+                sum += trait::to_trait<Value>(s).value();
+            }
+            do_not_optimize(sum);
+        });
+        run("operator_arrow_star", count, [&] {
+            int sum = 0;
+            for (auto &s : squares) {
+                sum += (s->*(&Value::value))();
+            }
+            do_not_optimize(sum);
+        });
+        run("traitref_construct_call", count, [&] {
+            int sum = 0;
+            for (auto &s : squares) {
+                sum += call_ref(s);
+            }
+            do_not_optimize(sum);
+        });
+        run("dyn_construct_call", count, [&] {
+            int sum = 0;
+            for (auto &s : squares) {
+                trait::Dyn<Value> d = s;
+                do_not_optimize(d);
+                sum += (d->*TRAIT_DYN_FN(&Value::value))();
+            }
+            do_not_optimize(sum);
+        });
+    }
+
+    // Polymorphic calls over the shuffled workload
+    {
+        std::vector<std::unique_ptr<virt::Base>> objs;
+        objs.reserve(count);
+        w.for_each_kind([&](int kind, int v, int extra) {
+            switch (kind) {
+            case 0:
+                objs.emplace_back(new virt::Square(v));
+                break;
+            case 1:
+                objs.emplace_back(new virt::Rect(v, extra));
+                break;
+            case 2:
+                objs.emplace_back(new virt::Tri(v, extra));
+                break;
+            default:
+                objs.emplace_back(new virt::Line(v));
+                break;
+            }
+        });
+        run("virtual_call", count, [&] {
+            int sum = 0;
+            for (auto &o : objs) {
+                sum += o->value();
+            }
+            do_not_optimize(sum);
+        });
+    }
+    {
+        std::vector<std::function<int()>> fns;
+        fns.reserve(count);
+        std::size_t s = 0, r = 0, t = 0, l = 0;
+        for (int kind : w.kinds) {
+            switch (kind) {
+            case 0: {
+                shapes::Square *p = &w.squares[s++];
+                fns.emplace_back([p] { return p->side * p->side; });
+                break;
+            }
+            case 1: {
+                shapes::Rect *p = &w.rects[r++];
+                fns.emplace_back([p] { return p->w * p->h; });
+                break;
+            }
+            case 2: {
+                shapes::Tri *p = &w.tris[t++];
+                fns.emplace_back([p] { return p->b * p->h / 2; });
+                break;
+            }
+            default: {
+                shapes::Line *p = &w.lines[l++];
+                fns.emplace_back([p] { return p->len; });
+                break;
+            }
+            }
+        }
+        run("std_function_call", count, [&] {
+            int sum = 0;
+            for (auto &f : fns) {
+                sum += f();
+            }
+            do_not_optimize(sum);
+        });
+    }
+    run("traitref_call", count, [&] {
+        int sum = 0;
+        for (auto &r : w.refs) {
+            sum += r->value();
+        }
+        do_not_optimize(sum);
+    });
+    run("dyn_call", count, [&] {
+        int sum = 0;
+        for (auto d : w.dyns) {
+            sum += (d->*TRAIT_DYN_FN(&Value::value))();
+        }
+        do_not_optimize(sum);
+    });
+    {
+        std::vector<trait::TraitRef<Doubled>> chained;
+        std::vector<trait::TraitRef<Value, Doubled>> multi;
+        chained.reserve(count);
+        multi.reserve(count);
+        for (auto &r : w.refs) {
+            chained.emplace_back(r);
+        }
+        std::size_t s = 0, r = 0, t = 0, l = 0;
+        for (int kind : w.kinds) {
+            switch (kind) {
+            case 0:
+                multi.emplace_back(w.squares[s++]);
+                break;
+            case 1:
+                multi.emplace_back(w.rects[r++]);
+                break;
+            case 2:
+                multi.emplace_back(w.tris[t++]);
+                break;
+            default:
+                multi.emplace_back(w.lines[l++]);
+                break;
+            }
+        }
+        run("blanket_chain_call", count, [&] {
+            int sum = 0;
+            for (auto &c : chained) {
+                sum += c->doubled();
+            }
+            do_not_optimize(sum);
+        });
+        run("blanket_multi_ref_call", count, [&] {
+            int sum = 0;
+            for (auto &m : multi) {
+                sum += m.get<Doubled>().doubled();
+            }
+            do_not_optimize(sum);
+        });
+    }
+    {
+        std::vector<trait::TraitUPtr<Value>> direct;
+        std::vector<trait::TraitUPtr<Value>> uptr;
+        std::vector<trait::TraitBox<Value>> boxes;
+        std::vector<trait::TraitValue<Value>> values;
+        std::vector<ShapeEnum> enums;
+        ShapeVec buckets;
+        direct.reserve(count);
+        uptr.reserve(count);
+        boxes.reserve(count);
+        values.reserve(count);
+        enums.reserve(count);
+        w.for_each_kind([&](int kind, int v, int extra) {
+            switch (kind) {
+            case 0:
+                direct.push_back(trait::make<Value, shapes::Square>(v));
+                uptr.push_back(trait::own<Value>(std::make_unique<shapes::Square>(shapes::Square{v})));
+                boxes.push_back(trait::make_box<Value, shapes::Square>(v));
+                values.push_back(trait::make_value<Value, shapes::Square>(v));
+                enums.push_back(shapes::Square{v});
+                buckets.push_back(shapes::Square{v});
+                break;
+            case 1:
+                direct.push_back(trait::make<Value, shapes::Rect>(v, extra));
+                uptr.push_back(trait::own<Value>(std::make_unique<shapes::Rect>(shapes::Rect{v, extra})));
+                boxes.push_back(trait::make_box<Value, shapes::Rect>(v, extra));
+                values.push_back(trait::make_value<Value, shapes::Rect>(v, extra));
+                enums.push_back(shapes::Rect{v, extra});
+                buckets.push_back(shapes::Rect{v, extra});
+                break;
+            case 2:
+                direct.push_back(trait::make<Value, shapes::Tri>(v, extra));
+                uptr.push_back(trait::own<Value>(std::make_unique<shapes::Tri>(shapes::Tri{v, extra})));
+                boxes.push_back(trait::make_box<Value, shapes::Tri>(v, extra));
+                values.push_back(trait::make_value<Value, shapes::Tri>(v, extra));
+                enums.push_back(shapes::Tri{v, extra});
+                buckets.push_back(shapes::Tri{v, extra});
+                break;
+            default:
+                direct.push_back(trait::make<Value, shapes::Line>(v));
+                uptr.push_back(trait::own<Value>(std::make_unique<shapes::Line>(shapes::Line{v})));
+                boxes.push_back(trait::make_box<Value, shapes::Line>(v));
+                values.push_back(trait::make_value<Value, shapes::Line>(v));
+                enums.push_back(shapes::Line{v});
+                buckets.push_back(shapes::Line{v});
+                break;
+            }
+        });
+        run("traituptr_direct_call", count, [&] {
+            int sum = 0;
+            for (auto &p : direct) {
+                sum += p->value();
+            }
+            do_not_optimize(sum);
+        });
+        run("traituptr_uptr_call", count, [&] {
+            int sum = 0;
+            for (auto &p : uptr) {
+                sum += p->value();
+            }
+            do_not_optimize(sum);
+        });
+        run("traitbox_call", count, [&] {
+            int sum = 0;
+            for (auto &b : boxes) {
+                sum += b->value();
+            }
+            do_not_optimize(sum);
+        });
+        run("traitvalue_call", count, [&] {
+            int sum = 0;
+            for (auto &v : values) {
+                sum += v->value();
+            }
+            do_not_optimize(sum);
+        });
+        run("traitenum_call", count, [&] {
+            int sum = 0;
+            for (auto &e : enums) {
+                sum += e.visit([](auto &impl) {
+                    return impl.value();
+                });
+            }
+            do_not_optimize(sum);
+        });
+        run("traitvec_for_each", count, [&] {
+            int sum = 0;
+            buckets.for_each([&sum](auto &impl) {
+                sum += impl.value();
+            });
+            do_not_optimize(sum);
+        });
+        // Snapshot of the heterogeneous objects, one clone per element
+        // against clone_all with a single allocation for the batch
+        run("clone_each_destroy", count, [&] {
+            std::vector<trait::TraitUPtr<Value>> copies;
+            copies.reserve(direct.size());
+            for (auto &p : direct) {
+                copies.push_back(trait::clone(p));
+            }
+            do_not_optimize(copies);
+        });
+        run("clone_all_destroy", count, [&] {
+            auto copies = trait::clone_all(direct);
+            do_not_optimize(copies);
+        });
+    }
+
+    // Allocation and destruction of owned trait objects
+    run("make_destroy", count, [&] {
+        int sum = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            auto p = trait::make<Value, shapes::Rect>(static_cast<int>(i), 3);
+            do_not_optimize(p);
+            sum += p->value();
+        }
+        do_not_optimize(sum);
+    });
+    run("own_unique_ptr_destroy", count, [&] {
+        int sum = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            auto p = trait::own<Value>(std::make_unique<shapes::Rect>(shapes::Rect{static_cast<int>(i), 3}));
+            do_not_optimize(p);
+            sum += p->value();
+        }
+        do_not_optimize(sum);
+    });
+    run("make_unique_virtual_destroy", count, [&] {
+        int sum = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            std::unique_ptr<virt::Base> p(new virt::Rect(static_cast<int>(i), 3));
+            do_not_optimize(p);
+            sum += p->value();
+        }
+        do_not_optimize(sum);
+    });
+    run("make_box_destroy", count, [&] {
+        int sum = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            auto p = trait::make_box<Value, shapes::Rect>(static_cast<int>(i), 3);
+            do_not_optimize(p);
+            sum += p->value();
+        }
+        do_not_optimize(sum);
+    });
+    run("make_value_destroy", count, [&] {
+        int sum = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            auto p = trait::make_value<Value, shapes::Rect>(static_cast<int>(i), 3);
+            do_not_optimize(p);
+            sum += p->value();
+        }
+        do_not_optimize(sum);
+    });
+    {
+        trait::PoolArena pool;
+        run("make_in_pool_destroy", count, [&] {
+            int sum = 0;
+            for (std::size_t i = 0; i < count; i++) {
+                auto p = trait::make_in<Value, shapes::Rect>(pool, static_cast<int>(i), 3);
+                do_not_optimize(p);
+                sum += p->value();
+            }
+            do_not_optimize(sum);
+        });
+    }
+}
+
+// TraitRef calls where one type makes up percent of the objects and the
+// other three share the rest, with and without dispatch_likely guessing
+// the dominant types
+void bench_skewed(std::size_t count, int percent) {
+    std::mt19937 rng(54321);
+    std::vector<shapes::Square> squares;
+    std::vector<shapes::Rect> rects;
+    std::vector<shapes::Tri> tris;
+    std::vector<shapes::Line> lines;
+    std::vector<trait::TraitRef<Value>> refs;
+    squares.reserve(count);
+    rects.reserve(count);
+    tris.reserve(count);
+    lines.reserve(count);
+    refs.reserve(count);
+    for (std::size_t i = 0; i < count; i++) {
+        int v = static_cast<int>(i % 97);
+        int kind = static_cast<int>(rng() % 100) < percent ? 0 : 1 + static_cast<int>(rng() % 3);
+        switch (kind) {
+        case 0:
+            squares.push_back(shapes::Square{v});
+            refs.emplace_back(squares.back());
+            break;
+        case 1:
+            rects.push_back(shapes::Rect{v, 3});
+            refs.emplace_back(rects.back());
+            break;
+        case 2:
+            tris.push_back(shapes::Tri{v, 4});
+            refs.emplace_back(tris.back());
+            break;
+        default:
+            lines.push_back(shapes::Line{v});
+            refs.emplace_back(lines.back());
+            break;
+        }
+    }
+    char name[64];
+    std::snprintf(name, sizeof(name), "skewed%d_traitref_call", percent);
+    run(name, count, [&] {
+        int sum = 0;
+        for (auto &r : refs) {
+            sum += r->value();
+        }
+        int result = sum;
+        do_not_optimize(result);
+    });
+    std::snprintf(name, sizeof(name), "skewed%d_dispatch_likely", percent);
+    run(name, count, [&] {
+        int sum = 0;
+        for (auto &r : refs) {
+            sum += trait::dispatch_likely<shapes::Square>(r, [](auto &impl) {
+                return impl.value();
+            });
+        }
+        int result = sum;
+        do_not_optimize(result);
+    });
+    std::snprintf(name, sizeof(name), "skewed%d_dispatch_likely2", percent);
+    run(name, count, [&] {
+        int sum = 0;
+        for (auto &r : refs) {
+            sum += trait::dispatch_likely<shapes::Square, shapes::Rect>(r, [](auto &impl) {
+                return impl.value();
+            });
+        }
+        int result = sum;
+        do_not_optimize(result);
+    });
+}
+
+// A map/filter/fold scan through the Iterator trait: fused over the
+// concrete type, one virtual next per item, and one next_chunk per chunk
+void bench_iter(std::size_t count) {
+    std::vector<int> values(count);
+    for (std::size_t i = 0; i < count; i++) {
+        values[i] = static_cast<int>(i % 97);
+    }
+    auto triple = [](int x) {
+        return x * 3;
+    };
+    auto even = [](int x) {
+        return x % 2 == 0;
+    };
+    auto add = [](int acc, int x) {
+        return acc + x;
+    };
+    run("iter_direct_loop", count, [&] {
+        int sum = 0;
+        for (int v : values) {
+            if (triple(v) % 2 == 0) {
+                sum += triple(v);
+            }
+        }
+        do_not_optimize(sum);
+    });
+    run("iter_static_fold", count, [&] {
+        Scan scan{values.data(), values.data() + count};
+        int sum = trait::iter<int>(scan).map(triple).filter(even).fold(0, add);
+        do_not_optimize(sum);
+    });
+    run("iter_dyn_next", count, [&] {
+        Scan scan{values.data(), values.data() + count};
+        trait::TraitRef<trait::Iterator<int>> ref(scan);
+        int sum = 0;
+        int v;
+        while (ref->next(v)) {
+            if (triple(v) % 2 == 0) {
+                sum += triple(v);
+            }
+        }
+        do_not_optimize(sum);
+    });
+    run("iter_dyn_chunk_fold", count, [&] {
+        Scan scan{values.data(), values.data() + count};
+        trait::TraitRef<trait::Iterator<int>> ref(scan);
+        int sum = trait::iter<int>(ref).map(triple).filter(even).fold(0, add);
+        do_not_optimize(sum);
+    });
+    run("iter_dyn_bulk_chunk_fold", count, [&] {
+        BulkScan scan{values.data(), values.data() + count};
+        trait::TraitRef<trait::Iterator<int>> ref(scan);
+        int sum = trait::iter<int>(ref).map(triple).filter(even).fold(0, add);
+        do_not_optimize(sum);
+    });
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::size_t> counts;
+    for (int i = 1; i < argc; i++) {
+        counts.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+    if (counts.empty()) {
+        counts = {1 << 10, 1 << 16, 1 << 22};
+    }
+    for (std::size_t count : counts) {
+        bench(count);
+        bench_iter(count);
+        for (int percent : {25, 50, 90, 99}) {
+            bench_skewed(count, percent);
+        }
+    }
+    return 0;
+}
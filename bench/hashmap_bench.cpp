@@ -0,0 +1,211 @@
+// trait::TraitHashMap against std::unordered_map keyed by TraitUPtr with
+// hasher and equality wrappers calling the Hash and Eq traits.
+//
+//   g++ -std=c++14 -O2 -I. -o hashmap_bench bench/hashmap_bench.cpp
+//   ./hashmap_bench [key counts...]
+//
+// Every result is printed as one JSON object per line:
+//   {"benchmark": "...", "keys": N, "ns_per_op": ...}
+// The keys are a mix of ints, pairs and short strings. "insert" builds the
+// map, "find_hit" and "find_miss" look up ints in random order: through a
+// trait object ("dyn") or through the concrete type ("base"), which
+// std::unordered_map can only do by wrapping it in a non-owning TraitUPtr.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "rust_trait.h"
+
+
+template<class T>
+inline void do_not_optimize(T &&value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+namespace keys {
+    struct Int {
+        int value;
+    };
+
+    struct Pair {
+        int a;
+        int b;
+    };
+
+    struct Name {
+        std::string name;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(trait::Hash, keys::Int) {
+    TRAIT_FOR_CLASS_SELF;
+    bool eq(trait::Eq &other) override {
+        Self *o = trait::try_cast<Self>(other);
+        return o && o->value == self.value;
+    }
+    std::size_t hash() override {
+        return std::size_t(self.value);
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(trait::Hash, keys::Pair) {
+    TRAIT_FOR_CLASS_SELF;
+    bool eq(trait::Eq &other) override {
+        Self *o = trait::try_cast<Self>(other);
+        return o && o->a == self.a && o->b == self.b;
+    }
+    std::size_t hash() override {
+        return std::size_t(self.a) * 31 + std::size_t(self.b);
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(trait::Hash, keys::Name) {
+    TRAIT_FOR_CLASS_SELF;
+    bool eq(trait::Eq &other) override {
+        Self *o = trait::try_cast<Self>(other);
+        return o && o->name == self.name;
+    }
+    std::size_t hash() override {
+        return std::hash<std::string>()(self.name);
+    }
+};
+
+// What the map replaces: std::unordered_map with wrappers around the traits
+struct KeyHash {
+    std::size_t operator()(const trait::TraitUPtr<trait::Hash> &key) const {
+        return key->hash();
+    }
+};
+
+struct KeyEq {
+    bool operator()(const trait::TraitUPtr<trait::Hash> &a, const trait::TraitUPtr<trait::Hash> &b) const {
+        return a->eq(*b);
+    }
+};
+
+using StdMap = std::unordered_map<trait::TraitUPtr<trait::Hash>, int, KeyHash, KeyEq>;
+using FlatMap = trait::TraitHashMap<trait::Hash, int>;
+
+void no_delete(trait::Hash*) {}
+
+template<class Fn>
+void run(const char *name, std::size_t keys, std::size_t ops, Fn &&fn) {
+    using clock = std::chrono::steady_clock;
+    fn();
+    std::size_t iterations = 0;
+    auto best = std::chrono::duration<double, std::nano>::max();
+    auto deadline = clock::now() + std::chrono::milliseconds(200);
+    do {
+        auto start = clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double, std::nano>(clock::now() - start));
+        iterations++;
+    } while (clock::now() < deadline || iterations < 3);
+    std::printf("{\"benchmark\": \"%s\", \"keys\": %zu, \"ns_per_op\": %.3f}\n", name, keys, best.count() / ops);
+    std::fflush(stdout);
+}
+
+// Key i of the map; ints are even, so odd ints miss
+trait::TraitUPtr<trait::Hash> make_key(std::size_t i) {
+    int v = static_cast<int>(i);
+    switch (i % 3) {
+    case 0:
+        return trait::make<trait::Hash, keys::Int>(v * 2);
+    case 1:
+        return trait::make<trait::Hash, keys::Pair>(v, v ^ 0x5555);
+    default:
+        return trait::make<trait::Hash, keys::Name>("key" + std::to_string(v));
+    }
+}
+
+void bench(std::size_t count) {
+    std::mt19937 rng(99);
+    std::vector<keys::Int> hits;
+    std::vector<keys::Int> misses;
+    for (std::size_t i = 0; i < count; i += 3) {
+        hits.push_back(keys::Int{static_cast<int>(i) * 2});
+        misses.push_back(keys::Int{static_cast<int>(i) * 2 + 1});
+    }
+    std::shuffle(hits.begin(), hits.end(), rng);
+    std::shuffle(misses.begin(), misses.end(), rng);
+
+    run("std_unordered_map/insert", count, count, [&] {
+        StdMap map;
+        map.reserve(count);
+        for (std::size_t i = 0; i < count; i++) {
+            map.emplace(make_key(i), static_cast<int>(i));
+        }
+        do_not_optimize(map);
+    });
+    run("trait_hashmap/insert", count, count, [&] {
+        FlatMap map;
+        map.reserve(count);
+        for (std::size_t i = 0; i < count; i++) {
+            map.emplace(make_key(i), static_cast<int>(i));
+        }
+        do_not_optimize(map);
+    });
+
+    StdMap std_map;
+    FlatMap flat_map;
+    for (std::size_t i = 0; i < count; i++) {
+        std_map.emplace(make_key(i), static_cast<int>(i));
+        flat_map.emplace(make_key(i), static_cast<int>(i));
+    }
+    for (int miss = 0; miss < 2; miss++) {
+        std::vector<keys::Int> &probes = miss ? misses : hits;
+        std::vector<trait::TraitRef<trait::Hash>> refs(probes.begin(), probes.end());
+        std::string prefix = miss ? "/find_miss_" : "/find_hit_";
+        run(("std_unordered_map" + prefix + "dyn").c_str(), count, probes.size(), [&] {
+            int sum = 0;
+            for (auto &ref : refs) {
+                auto it = std_map.find(trait::TraitUPtr<trait::Hash>(&*ref, no_delete));
+                sum += it == std_map.end() ? 0 : it->second;
+            }
+            do_not_optimize(sum);
+        });
+        run(("trait_hashmap" + prefix + "dyn").c_str(), count, probes.size(), [&] {
+            int sum = 0;
+            for (auto &ref : refs) {
+                int *value = flat_map.find(ref);
+                sum += value ? *value : 0;
+            }
+            do_not_optimize(sum);
+        });
+        run(("std_unordered_map" + prefix + "base").c_str(), count, probes.size(), [&] {
+            int sum = 0;
+            for (auto &probe : probes) {
+                trait::TraitRef<trait::Hash> ref(probe);
+                auto it = std_map.find(trait::TraitUPtr<trait::Hash>(&*ref, no_delete));
+                sum += it == std_map.end() ? 0 : it->second;
+            }
+            do_not_optimize(sum);
+        });
+        run(("trait_hashmap" + prefix + "base").c_str(), count, probes.size(), [&] {
+            int sum = 0;
+            for (auto &probe : probes) {
+                int *value = flat_map.find(probe);
+                sum += value ? *value : 0;
+            }
+            do_not_optimize(sum);
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::size_t> counts;
+    for (int i = 1; i < argc; i++) {
+        counts.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+    if (counts.empty()) {
+        counts = {1 << 10, 1 << 16, 1 << 20};
+    }
+    for (std::size_t count : counts) {
+        bench(count);
+    }
+    return 0;
+}
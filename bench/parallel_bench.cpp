@@ -0,0 +1,164 @@
+// Scaling of trait::parallel_for_each against a sequential loop.
+//
+//   g++ -std=c++14 -O2 -pthread -I. -o parallel_bench bench/parallel_bench.cpp
+//   ./parallel_bench [worker counts...]
+//
+// Every result is printed as one JSON object per line:
+//   {"benchmark": "...", "workers": N, "objects": N, "ns_per_op": ...}
+// "grouped" stores the objects sorted by type, "shuffled" in random order;
+// "static" is the single type fast path over a plain vector of objects.
+// A pool with N workers runs on N + 1 threads, as the caller works too.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+#include "rust_trait.h"
+
+
+template<class T>
+inline void do_not_optimize(T &&value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Work {
+    virtual unsigned work() = 0;
+};
+
+namespace shapes {
+    struct Square {
+        unsigned side;
+    };
+
+    struct Rect {
+        unsigned w;
+        unsigned h;
+    };
+
+    struct Line {
+        unsigned len;
+    };
+}
+
+// A few dozen cycles of work per call, so the loop is not memory bound
+inline unsigned mix(unsigned x) {
+    for (int i = 0; i < 8; i++) {
+        x = x * 2654435761u + 0x9e3779b9u;
+        x ^= x >> 13;
+    }
+    return x;
+}
+
+IMPL_TRAIT_FOR_CLASS(Work, shapes::Square) {
+    TRAIT_FOR_CLASS_SELF;
+    unsigned work() override {
+        return mix(self.side * self.side);
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Work, shapes::Rect) {
+    TRAIT_FOR_CLASS_SELF;
+    unsigned work() override {
+        return mix(self.w * self.h);
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Work, shapes::Line) {
+    TRAIT_FOR_CLASS_SELF;
+    unsigned work() override {
+        return mix(self.len);
+    }
+};
+
+constexpr std::size_t objects = 1 << 20;
+
+template<class Fn>
+void run(const char *name, std::size_t workers, Fn &&fn) {
+    using clock = std::chrono::steady_clock;
+    fn();
+    auto best = std::chrono::duration<double, std::nano>::max();
+    for (int i = 0; i < 5; i++) {
+        auto start = clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double, std::nano>(clock::now() - start));
+    }
+    std::printf("{\"benchmark\": \"%s\", \"workers\": %zu, \"objects\": %zu, \"ns_per_op\": %.3f}\n",
+                name, workers, objects, best.count() / objects);
+    std::fflush(stdout);
+}
+
+std::vector<trait::TraitUPtr<Work>> make_objects(bool grouped) {
+    std::mt19937 rng(777);
+    std::vector<int> kinds(objects);
+    for (auto &kind : kinds) {
+        kind = static_cast<int>(rng() % 3);
+    }
+    if (grouped) {
+        std::sort(kinds.begin(), kinds.end());
+    }
+    std::vector<trait::TraitUPtr<Work>> result;
+    result.reserve(objects);
+    for (std::size_t i = 0; i < objects; i++) {
+        unsigned v = static_cast<unsigned>(i);
+        switch (kinds[i]) {
+        case 0:
+            result.push_back(trait::make<Work, shapes::Square>(v));
+            break;
+        case 1:
+            result.push_back(trait::make<Work, shapes::Rect>(v, 3u));
+            break;
+        default:
+            result.push_back(trait::make<Work, shapes::Line>(v));
+            break;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::size_t> workers;
+    for (int i = 1; i < argc; i++) {
+        workers.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+    if (workers.empty()) {
+        std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        for (std::size_t w = 0; w < cores; w = w ? w * 2 : 1) {
+            workers.push_back(w);
+        }
+        workers.push_back(cores - 1);
+    }
+    auto grouped = make_objects(true);
+    auto shuffled = make_objects(false);
+    std::vector<shapes::Square> squares(objects);
+    for (std::size_t i = 0; i < objects; i++) {
+        squares[i].side = static_cast<unsigned>(i);
+    }
+    run("sequential/shuffled", 0, [&] {
+        unsigned sum = 0;
+        for (auto &p : shuffled) {
+            sum += p->work();
+        }
+        do_not_optimize(sum);
+    });
+    for (std::size_t w : workers) {
+        trait::ThreadPool pool(w);
+        run("parallel/grouped", w, [&] {
+            trait::parallel_for_each(pool, grouped, [&](Work &work) {
+                do_not_optimize(work.work());
+            });
+        });
+        run("parallel/shuffled", w, [&] {
+            trait::parallel_for_each(pool, shuffled, [&](Work &work) {
+                do_not_optimize(work.work());
+            });
+        });
+        run("parallel/static", w, [&] {
+            trait::parallel_for_each<Work>(pool, squares, [&](auto &impl) {
+                do_not_optimize(impl.work());
+            });
+        });
+    }
+    return 0;
+}
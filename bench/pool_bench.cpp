@@ -0,0 +1,158 @@
+// Multi-threaded allocation benchmark: trait::make (global allocator)
+// against trait::make_pooled (SharedPool).
+//
+//   g++ -std=c++14 -O2 -pthread -I. -o pool_bench bench/pool_bench.cpp
+//   ./pool_bench [thread counts...]
+//
+// Every result is printed as one JSON object per line:
+//   {"benchmark": "...", "threads": N, "ns_per_op": ..., "mops_per_sec": ...}
+// ns_per_op is wall time divided by the operations of one thread, so it
+// stays flat when an allocator scales. "local" keeps a window of live
+// objects per thread and replaces them one by one; "remote" hands every
+// object to the next thread, which drops it.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "rust_trait.h"
+
+
+struct Value {
+    virtual int value() = 0;
+};
+
+namespace shapes {
+    struct Rect {
+        int w;
+        int h;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(Value, shapes::Rect) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.w * self.h;
+    }
+};
+
+struct Make {
+    static trait::TraitUPtr<Value> make(int i) {
+        return trait::make<Value, shapes::Rect>(i, 2);
+    }
+};
+
+struct MakePooled {
+    static trait::TraitUPtr<Value> make(int i) {
+        return trait::make_pooled<Value, shapes::Rect>(i, 2);
+    }
+};
+
+struct Barrier {
+    std::size_t threads;
+    std::atomic<std::size_t> waiting{0};
+    std::atomic<std::size_t> generation{0};
+
+    explicit Barrier(std::size_t threads_) : threads(threads_) {}
+
+    void wait() {
+        std::size_t current = generation.load(std::memory_order_acquire);
+        if (waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == threads) {
+            waiting.store(0, std::memory_order_relaxed);
+            generation.fetch_add(1, std::memory_order_release);
+            return;
+        }
+        while (generation.load(std::memory_order_acquire) == current) {
+            std::this_thread::yield();
+        }
+    }
+};
+
+constexpr std::size_t window = 64;
+constexpr std::size_t operations = 1 << 20;
+constexpr std::size_t handoff = 256;
+
+template<class Fn>
+void run(const char *name, std::size_t threads, std::size_t ops, Fn &&fn) {
+    Barrier start(threads + 1);
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> sink{0};
+    for (std::size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            start.wait();
+            sink.fetch_add(fn(t), std::memory_order_relaxed);
+        });
+    }
+    start.wait();
+    auto begin = std::chrono::steady_clock::now();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+    std::printf("{\"benchmark\": \"%s\", \"threads\": %zu, \"ns_per_op\": %.3f, \"mops_per_sec\": %.3f, \"check\": %zu}\n",
+                name, threads, ns / ops, threads * ops / ns * 1e3, sink.load());
+}
+
+template<class Policy>
+void bench_local(const char *name, std::size_t threads) {
+    run(name, threads, operations, [](std::size_t) {
+        std::vector<trait::TraitUPtr<Value>> live;
+        for (std::size_t i = 0; i < window; i++) {
+            live.push_back(Policy::make(int(i)));
+        }
+        std::size_t sum = 0;
+        for (std::size_t i = 0; i < operations; i++) {
+            auto &slot = live[i % window];
+            sum += slot->value();
+            slot = Policy::make(int(i));
+        }
+        return sum;
+    });
+}
+
+template<class Policy>
+void bench_remote(const char *name, std::size_t threads) {
+    std::vector<std::vector<trait::TraitUPtr<Value>>> slots(threads);
+    Barrier round(threads);
+    run(name, threads, operations, [&](std::size_t t) {
+        std::size_t sum = 0;
+        for (std::size_t r = 0; r < operations / handoff; r++) {
+            for (std::size_t i = 0; i < handoff; i++) {
+                slots[t].push_back(Policy::make(int(i)));
+            }
+            round.wait();
+            auto &next = slots[(t + 1) % slots.size()];
+            for (auto &ptr : next) {
+                sum += ptr->value();
+            }
+            next.clear();
+            round.wait();
+        }
+        return sum;
+    });
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::size_t> threads;
+    for (int i = 1; i < argc; i++) {
+        threads.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+    if (threads.empty()) {
+        std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        for (std::size_t t = 1; t < cores; t *= 2) {
+            threads.push_back(t);
+        }
+        threads.push_back(cores);
+    }
+    for (std::size_t t : threads) {
+        bench_local<Make>("make/local", t);
+        bench_local<MakePooled>("make_pooled/local", t);
+        bench_remote<Make>("make/remote", t);
+        bench_remote<MakePooled>("make_pooled/remote", t);
+    }
+    return 0;
+}
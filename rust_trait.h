@@ -1,17 +1,110 @@
+#include <algorithm>
 #include <functional>
+#include <initializer_list>
 #include <type_traits>
 #include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <cstdint>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
+// Async trait methods need C++20 coroutines; define TRAIT_COROUTINES to 0
+// to leave them out
+#ifndef TRAIT_COROUTINES
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define TRAIT_COROUTINES 1
+#endif
+#endif
+#endif
+#ifndef TRAIT_COROUTINES
+#define TRAIT_COROUTINES 0
+#endif
+#if TRAIT_COROUTINES
+#include <coroutine>
+#include <optional>
+#include <stdexcept>
+#endif
+
+// Per-impl call, cycle and allocation counters, see TRAIT_PROFILE_SCOPE.
+// Compiled out unless TRAIT_PROFILE is 1; TRAIT_PROFILE_CYCLES also times
+// the profiled methods
+#ifndef TRAIT_PROFILE
+#define TRAIT_PROFILE 0
+#endif
+#ifndef TRAIT_PROFILE_CYCLES
+#define TRAIT_PROFILE_CYCLES 0
+#endif
+#if TRAIT_PROFILE
+#include <chrono>
+#include <ostream>
+#include <string>
+#endif
+
+// Trait resolution backend: 14 uses SFINAE and recursive templates only,
+// 17 folds trait lists with std::conjunction, 20 also constrains the global
+// __trait_impl overloads with requires clauses and adds trait::implements.
+// Trait bounds of IMPL_TRAIT_FOR_TRAIT/GENERIC stay SFINAE on every backend:
+// bounds may be cyclic (Odd/Even), and constraint satisfaction may not
+// depend on itself. Defaults to the newest backend the compiler supports;
+// define TRAIT_BACKEND to pick one
+#ifndef TRAIT_BACKEND
+#if defined(__cpp_concepts) && __cpp_concepts >= 201907L && defined(__cpp_lib_logical_traits)
+#define TRAIT_BACKEND 20
+#elif defined(__cpp_lib_logical_traits) && defined(__cpp_inline_variables)
+#define TRAIT_BACKEND 17
+#else
+#define TRAIT_BACKEND 14
+#endif
+#endif
+// The backends define is_trait_h and its helpers differently, so each one
+// lives in its own inline namespace and translation units built with
+// different backends do not share definitions
+#define __TRAIT_BACKEND_NAMESPACE_(backend) __backend##backend
+#define __TRAIT_BACKEND_NAMESPACE(backend) __TRAIT_BACKEND_NAMESPACE_(backend)
+
+
+// The impl macros declare __trait_impl in the global namespace, which ADL
+// only searches when the trait or the type is declared there. Passing this
+// to __TraitTypeCheck makes it searched for traits like trait::Iterator too
+struct __TraitGlobalScope;
 
 namespace trait {
+    // Whether T is copy constructible, also looking into the value_type of
+    // containers, which declare a copy constructor whether or not their
+    // elements can be copied
+    template<class T, class = void>
+    struct __TraitCopyable : public std::is_copy_constructible<T> {};
+
+    template<class T>
+    struct __TraitCopyable<T, std::enable_if_t<!std::is_same<typename T::value_type, T>::value>>
+        : public std::integral_constant<bool, std::is_copy_constructible<T>::value &&
+                                              __TraitCopyable<std::remove_cv_t<typename T::value_type>>::value> {};
+
+    // Whether clone copies a Base. Every make and own instantiates the
+    // copy of its Base, so a type declaring a copy constructor that does
+    // not compile has to specialize this as std::false_type
+    template<class Base>
+    struct TraitClone : public __TraitCopyable<Base> {};
+
     namespace __impl {
+    inline namespace __TRAIT_BACKEND_NAMESPACE(TRAIT_BACKEND) {
         // When TraitA is a base of TraitB,
         // __TraitTypeCheck<TraitA> can be
         // converted to __TraitTypeCheck<TraitB>
         // e.g. __TraitTypeCheck<A> = check ? super A
-        template<typename Trait>
+        template<typename Trait, typename __Scope = ::__TraitGlobalScope>
         struct __TraitTypeCheck {
             __TraitTypeCheck() = default;
             template<typename TraitB>
@@ -30,12 +123,21 @@ namespace trait {
         template<typename Trait_, typename Base_>
         auto __has_trait_impl(Trait_ *, Base_ *)->
             __has_trait_impl_result<decltype(__trait_impl(__TraitTypeCheck<Trait_>(), static_cast<Base_*>(nullptr))), true>;
+#if TRAIT_BACKEND >= 17
+        // std::conjunction stops instantiating at the first trait that is
+        // not implemented and derives from it, like the recursive version
+        template<typename Base_, typename Trait_, typename ...OtherTraits>
+        struct is_trait_h :
+            public std::conjunction<is_trait_h<Base_, Trait_>, is_trait_h<Base_, OtherTraits>...> {
+        };
+#else
         template<typename Base_, typename Trait_, typename ...OtherTraits>
         struct is_trait_h :
             public std::conditional_t<bool(is_trait_h<Base_, Trait_>::value),
                                       is_trait_h<Base_, OtherTraits...>,
                                       is_trait_h<Base_, Trait_>> {
         };
+#endif
 
         template<typename Base_, typename Trait_>
         struct is_trait_h<Base_, Trait_> {
@@ -46,6 +148,13 @@ namespace trait {
             constexpr static bool value = __result::value;
         };
 
+#if TRAIT_BACKEND >= 17
+        template<typename ...TraitH>
+        struct __is_trait_h_conj : public std::conjunction<TraitH...> {};
+
+        template<typename Base_, typename Trait_, typename ...OtherTraits>
+        inline constexpr bool is_trait = is_trait_h<Base_, Trait_, OtherTraits...>::value;
+#else
         template<typename ...TraitH>
         struct __is_trait_h_conj : public std::true_type {};
 
@@ -58,6 +167,12 @@ namespace trait {
 
         template<typename Base_, typename Trait_, typename ...OtherTraits>
         constexpr bool is_trait = is_trait_h<Base_, Trait_, OtherTraits...>::value;
+#endif
+
+#if TRAIT_BACKEND >= 20
+        template<typename Base_, typename Trait_, typename ...OtherTraits>
+        concept implements = is_trait_h<Base_, Trait_, OtherTraits...>::value;
+#endif
 
 
         template<typename Base_, typename Trait_, typename ...OtherTraits>
@@ -118,13 +233,84 @@ namespace trait {
             return __TraitCastHelper<Base>()(std::forward<Trait>(trait));
         }
 
+        // Identity of a (Trait, Base) impl without RTTI. Every final
+        // TraitImpl has its own virtual table, so the virtual table pointer
+        // at the start of a trait object identifies the impl. The expected
+        // value is read from a probe object, which the optimizer folds into
+        // the address of the virtual table. The probe refers to storage for
+        // a Self that is never constructed or accessed
+        using TraitTypeId = const void*;
+
+        template<class TraitImpl>
+        TraitTypeId __trait_impl_id() noexcept {
+            using Self = typename TraitImpl::__Self;
+            union __Storage {
+                Self self;
+                __Storage() noexcept {}
+                ~__Storage() {}
+            } storage;
+            TraitImpl probe{storage.self};
+            return *reinterpret_cast<const TraitTypeId*>(&probe);
+        }
+
+        template<class Trait>
+        TraitTypeId type_id(Trait &trait) noexcept {
+            static_assert(std::is_polymorphic<Trait>::value, "type identity needs a trait with virtual functions");
+            return *reinterpret_cast<const TraitTypeId*>(&trait);
+        }
+
+        template<class Trait, class Base>
+        TraitTypeId type_id() noexcept {
+            static_assert(std::is_polymorphic<Trait>::value, "type identity needs a trait with virtual functions");
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            return __trait_impl_id<typename is_trait_h<Base, Trait>::TraitImpl>();
+        }
+
+        // Checked version of cast: Base* when trait was made from a Base,
+        // nullptr otherwise. Base must be the type the impl is written for,
+        // a class that only inherits an impl shares the identity of its base
+        template<class Base, class Trait>
+        Base *try_cast(Trait &trait) noexcept {
+            static_assert(std::is_polymorphic<Trait>::value, "type identity needs a trait with virtual functions");
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+            static_assert(std::is_same<typename TraitImpl::__Self, Base>::value,
+                          "Base inherits its impl, try_cast to the type the impl is written for");
+            if (type_id(trait) != __trait_impl_id<TraitImpl>()) {
+                return nullptr;
+            }
+            return &static_cast<TraitImpl&>(trait).self;
+        }
+
         struct __EmptyTraitTarget final {};
 
         template<class Trait>
         using TraitUPtr = std::unique_ptr<Trait, void(*)(Trait*)>;
 
+        // Owning handles other than TraitUPtr specialize this with a Trait
+        // type and a static get() returning the held trait object, so that
+        // TraitRef, to_trait and is_trait accept them like TraitUPtr
+        template<class Handle>
+        struct __TraitHandleTraits {};
+
+        template<class Trait, class ...OtherTraits>
+        struct TraitRef;
+
+        // Position of the first trait in Traits that derives from Trait
+        template<class Trait, class ...Traits>
+        struct __TraitRefIndex {
+            constexpr static bool found = false;
+            constexpr static std::size_t value = 0;
+        };
+
+        template<class Trait, class First, class ...Rest>
+        struct __TraitRefIndex<Trait, First, Rest...> {
+            constexpr static bool found = std::is_base_of<Trait, First>::value || __TraitRefIndex<Trait, Rest...>::found;
+            constexpr static std::size_t value = std::is_base_of<Trait, First>::value ? 0 : __TraitRefIndex<Trait, Rest...>::value + 1;
+        };
+
         template<class Trait>
-        struct TraitRef final {
+        struct TraitRef<Trait> final {
             alignas(__TraitImplBase<Trait, __EmptyTraitTarget>) char buffer[sizeof(__TraitImplBase<Trait, __EmptyTraitTarget>)];
             template<class Base, class __assert=trait_assert<Base, Trait>>
             TraitRef(Base &&base) {
@@ -137,6 +323,12 @@ namespace trait {
             }
             TraitRef(Trait &trait): TraitRef{reinterpret_cast<TraitRef&>(trait)} {}
             TraitRef(TraitUPtr<Trait> &ptr): TraitRef(reinterpret_cast<TraitRef&>(*ptr)) {}
+            template<class Handle,
+                     class __assert=std::enable_if_t<std::is_same<typename __TraitHandleTraits<Handle>::Trait, Trait>::value>>
+            TraitRef(Handle &handle): TraitRef(reinterpret_cast<TraitRef&>(__TraitHandleTraits<Handle>::get(handle))) {}
+            template<class ...Traits,
+                     class __assert=std::enable_if_t<(sizeof...(Traits) > 1) && __TraitRefIndex<Trait, Traits...>::found>>
+            TraitRef(TraitRef<Traits...> &multi): TraitRef(multi.template get<Trait>()) {}
             TraitRef(TraitRef &) = default;
             TraitRef(TraitRef &&) = default;
             operator Trait*() {
@@ -153,6 +345,77 @@ namespace trait {
             Base &cast() {
                 return trait::__impl::cast<Base>(**this);
             }
+
+            template<class Base>
+            Base *try_cast() {
+                return trait::__impl::try_cast<Base>(**this);
+            }
+
+            TraitTypeId type_id() {
+                return trait::__impl::type_id(**this);
+            }
+        };
+
+        // Reference to one object through several traits. Every trait is
+        // resolved against the original Base, so a trait implemented by a
+        // blanket impl dispatches once to the real object instead of going
+        // through another TraitRef. Converting to TraitRef<T> for a listed
+        // trait copies the stored trait object
+        template<class Trait, class ...OtherTraits>
+        struct TraitRef final {
+            using __Traits = std::tuple<Trait, OtherTraits...>;
+            alignas(TraitRef<Trait>) char buffer[(1 + sizeof...(OtherTraits)) * sizeof(TraitRef<Trait>)];
+            template<class Base, class __assert=trait_assert<Base, Trait, OtherTraits...>>
+            TraitRef(Base &&base) {
+                __init(std::integral_constant<std::size_t, 0>(), base);
+            }
+            template<class ...Traits,
+                     class __assert=std::enable_if_t<__is_trait_h_conj<std::integral_constant<bool, __TraitRefIndex<Trait, Traits...>::found>,
+                                                                       std::integral_constant<bool, __TraitRefIndex<OtherTraits, Traits...>::found>...>::value>>
+            TraitRef(TraitRef<Traits...> &other) {
+                __init(std::integral_constant<std::size_t, 0>(), other);
+            }
+            TraitRef(TraitRef &) = default;
+            TraitRef(TraitRef &&) = default;
+
+            template<class T>
+            std::tuple_element_t<__TraitRefIndex<T, Trait, OtherTraits...>::value, __Traits> &get() {
+                static_assert(__TraitRefIndex<T, Trait, OtherTraits...>::found, "trait not in this TraitRef");
+                using Stored = std::tuple_element_t<__TraitRefIndex<T, Trait, OtherTraits...>::value, __Traits>;
+                return *reinterpret_cast<Stored*>(buffer + __TraitRefIndex<T, Trait, OtherTraits...>::value * sizeof(TraitRef<Trait>));
+            }
+            Trait& operator*() {
+                return get<Trait>();
+            }
+            Trait* operator->() {
+                return &get<Trait>();
+            }
+
+            template<class Base>
+            Base &cast() {
+                return trait::__impl::cast<Base>(**this);
+            }
+
+            template<class Base>
+            Base *try_cast() {
+                return trait::__impl::try_cast<Base>(**this);
+            }
+
+            TraitTypeId type_id() {
+                return trait::__impl::type_id(**this);
+            }
+
+            template<std::size_t I, class Source>
+            void __init(std::integral_constant<std::size_t, I>, Source &source) {
+                using Stored = std::tuple_element_t<I, __Traits>;
+                static_assert(sizeof(TraitRef<Stored>) == sizeof(TraitRef<Trait>) && alignof(TraitRef<Stored>) <= alignof(TraitRef<Trait>),
+                              "cannot accept a non-standard trait: size/alignment not match");
+                new(buffer + I * sizeof(TraitRef<Trait>)) TraitRef<Stored>(source);
+                __init(std::integral_constant<std::size_t, I + 1>(), source);
+            }
+
+            template<class Source>
+            void __init(std::integral_constant<std::size_t, 1 + sizeof...(OtherTraits)>, Source &) {}
         };
 
         template<class Trait>
@@ -176,6 +439,131 @@ namespace trait {
             using trait_type=T;
         };
 
+        // Virtual table pointers of the impls of Trait referenced by
+        // TraitRefCompact, indexed from 1 so that all zero bits are the
+        // empty reference. Entries are appended under the lock and never
+        // change, and a compact reference is only handed to another thread
+        // after the entry of its index was written. The table has Impls
+        // entries, of which Impls - 1 are impls since index 0 is empty
+        template<class Trait, std::size_t Impls>
+        struct __TraitCompactTable final {
+            static_assert(Impls >= 2 && Impls <= (std::size_t(1) << 16), "Impls must be in [2, 65536]");
+            constexpr static std::size_t limit = Impls;
+            static TraitTypeId impls[limit];
+
+            static std::uint16_t index_of(TraitTypeId id) {
+                static std::mutex mutex;
+                static std::vector<std::pair<TraitTypeId, std::uint16_t>> ids;
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = std::lower_bound(ids.begin(), ids.end(), id,
+                                           [](const std::pair<TraitTypeId, std::uint16_t> &item, TraitTypeId key) {
+                                               return std::less<TraitTypeId>()(item.first, key);
+                                           });
+                if (it != ids.end() && it->first == id) {
+                    return it->second;
+                }
+                if (ids.size() + 1 >= limit) {
+                    std::terminate();
+                }
+                std::uint16_t index = static_cast<std::uint16_t>(ids.size() + 1);
+                impls[index] = id;
+                ids.insert(it, std::make_pair(id, index));
+                return index;
+            }
+        };
+
+        template<class Trait, std::size_t Impls>
+        TraitTypeId __TraitCompactTable<Trait, Impls>::impls[__TraitCompactTable<Trait, Impls>::limit];
+
+        // TraitRef in 8 bytes: the low 48 bits hold the address of the
+        // object and the high 16 bits the index of its impl in
+        // __TraitCompactTable<Trait, Impls>, instead of a virtual table
+        // pointer next to every reference. Access expands it into a
+        // TraitRef, which costs one load from the table. Taking the address
+        // of an object above the 48 bit range, or referencing more than
+        // Impls - 1 impls of Trait, calls std::terminate
+        template<class Trait, std::size_t Impls = 256>
+        struct TraitRefCompact final {
+            static_assert(sizeof(TraitRef<Trait>) == 2 * sizeof(void*) && sizeof(void*) <= sizeof(std::uint64_t),
+                          "cannot accept a non-standard trait: size not match");
+            constexpr static int address_bits = 48;
+            constexpr static std::uint64_t address_mask = (std::uint64_t(1) << address_bits) - 1;
+
+            std::uint64_t bits = 0;
+
+            TraitRefCompact() = default;
+            template<class Base,
+                     class __assert=trait_assert<Base, Trait>,
+                     class __not_ref=typename __TraitRefTest<std::decay_t<Base>>::type>
+            TraitRefCompact(Base &&base) {
+                static_assert(std::is_lvalue_reference<Base>::value, "TraitRefCompact cannot refer to a temporary");
+                using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                static const std::uint16_t index = __TraitCompactTable<Trait, Impls>::index_of(__trait_impl_id<TraitImpl>());
+                TraitImpl impl{base};
+                __pack(index, std::addressof(impl.self));
+            }
+            TraitRefCompact(TraitRef<Trait> ref) {
+                const void *words[2];
+                std::memcpy(words, ref.buffer, sizeof(words));
+                __pack(__index(static_cast<TraitTypeId>(words[0])), words[1]);
+            }
+            TraitRefCompact(Trait &trait): TraitRefCompact(TraitRef<Trait>(trait)) {}
+            TraitRefCompact(TraitUPtr<Trait> &ptr): TraitRefCompact(TraitRef<Trait>(ptr)) {}
+            template<class Handle,
+                     class __assert=std::enable_if_t<std::is_same<typename __TraitHandleTraits<Handle>::Trait, Trait>::value>>
+            TraitRefCompact(Handle &handle): TraitRefCompact(TraitRef<Trait>(handle)) {}
+
+            explicit operator bool() const noexcept {
+                return bits != 0;
+            }
+
+            TraitRef<Trait> get() const noexcept {
+                const void *words[2] = {__TraitCompactTable<Trait, Impls>::impls[bits >> address_bits],
+                                        reinterpret_cast<const void*>(static_cast<std::uintptr_t>(bits & address_mask))};
+                return TraitRef<Trait>(*reinterpret_cast<Trait*>(words));
+            }
+            operator TraitRef<Trait>() const noexcept {
+                return get();
+            }
+            // Returns the expanded TraitRef, whose operator-> is applied in
+            // turn; it lives until the end of the full expression
+            TraitRef<Trait> operator->() const noexcept {
+                return get();
+            }
+
+            template<class Base>
+            Base &cast() const {
+                return get().template cast<Base>();
+            }
+
+            template<class Base>
+            Base *try_cast() const {
+                return get().template try_cast<Base>();
+            }
+
+            TraitTypeId type_id() const noexcept {
+                return __TraitCompactTable<Trait, Impls>::impls[bits >> address_bits];
+            }
+
+            void __pack(std::uint16_t index, const void *address) {
+                std::uint64_t value = reinterpret_cast<std::uintptr_t>(address);
+                if (value >> address_bits) {
+                    std::terminate();
+                }
+                bits = std::uint64_t(index) << address_bits | value;
+            }
+
+            // Impls seen through a TraitRef are looked up under the lock of
+            // the table, one cached per thread
+            static std::uint16_t __index(TraitTypeId id) {
+                thread_local std::pair<TraitTypeId, std::uint16_t> last{nullptr, 0};
+                if (last.first != id) {
+                    last = std::make_pair(id, __TraitCompactTable<Trait, Impls>::index_of(id));
+                }
+                return last.second;
+            }
+        };
+
         template<class Trait, class Base,
                  class __assert=typename __TraitRefTest<Base>::type,
                  class __not_ref=typename __TraitRefTest<typename is_trait_h<Base, Trait>::TraitImpl>::type>
@@ -195,6 +583,18 @@ namespace trait {
             return *value;
         }
 
+        template<class Trait, class ...Traits,
+                 class __assert=std::enable_if_t<(sizeof...(Traits) > 1)>>
+        decltype(auto) to_trait(TraitRef<Traits...> &value) {
+            return value.template get<Trait>();
+        }
+
+        template<class Trait, class ...Traits,
+                 class __assert=std::enable_if_t<(sizeof...(Traits) > 1)>>
+        decltype(auto) to_trait(TraitRef<Traits...> &&value) {
+            return value.template get<Trait>();
+        }
+
         template<class Trait, class Trait2>
         std::enable_if_t<std::is_base_of<Trait, Trait2>::value, Trait2&> to_trait(TraitUPtr<Trait2> &value) {
             return *value;
@@ -205,12 +605,440 @@ namespace trait {
             return *value;
         }
 
+        template<class Base, class Trait>
+        Base *try_cast(TraitUPtr<Trait> &ptr) noexcept {
+            return ptr ? try_cast<Base>(*ptr) : nullptr;
+        }
+
+        template<class Trait>
+        TraitTypeId type_id(TraitUPtr<Trait> &ptr) noexcept {
+            return ptr ? type_id(*ptr) : nullptr;
+        }
+
+        template<class ...Bases>
+        struct __LikelyBases {};
+
+        template<class Trait, class Fn>
+        decltype(auto) __dispatch_likely(__LikelyBases<>, Trait &trait, TraitTypeId, Fn &fn) {
+            return fn(trait);
+        }
+
+        template<class Base, class ...Bases, class Trait, class Fn>
+        decltype(auto) __dispatch_likely(__LikelyBases<Base, Bases...>, Trait &trait, TraitTypeId id, Fn &fn) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+            if (id == __trait_impl_id<TraitImpl>()) {
+                return fn(static_cast<TraitImpl&>(trait));
+            }
+            return __dispatch_likely(__LikelyBases<Bases...>(), trait, id, fn);
+        }
+
+        // Guarded devirtualization for call sites dominated by a few types.
+        // When trait was made from one of Bases, checked in order, fn gets
+        // the final TraitImpl of that Base and its calls bind statically;
+        // otherwise fn gets the Trait and calls go through the virtual table.
+        // fn must return the same type for every argument
+        template<class ...Bases, class Trait, class Fn>
+        decltype(auto) dispatch_likely(Trait &trait, Fn &&fn) {
+            static_assert(std::is_polymorphic<Trait>::value, "type identity needs a trait with virtual functions");
+            return __dispatch_likely(__LikelyBases<Bases...>(), trait, type_id(trait), fn);
+        }
+
+        template<class ...Bases, class Trait, class Fn>
+        decltype(auto) dispatch_likely(TraitRef<Trait> &ref, Fn &&fn) {
+            return dispatch_likely<Bases...>(*ref, fn);
+        }
+
+        template<class ...Bases, class Trait, class Fn>
+        decltype(auto) dispatch_likely(TraitUPtr<Trait> &ptr, Fn &&fn) {
+            return dispatch_likely<Bases...>(*ptr, fn);
+        }
+
+        template<class Trait, class Handle,
+                 class HandleTrait=typename __TraitHandleTraits<std::remove_reference_t<Handle>>::Trait>
+        std::enable_if_t<std::is_base_of<Trait, HandleTrait>::value, HandleTrait&> to_trait(Handle &&value) {
+            return __TraitHandleTraits<std::remove_reference_t<Handle>>::get(value);
+        }
+
         template<template<typename> class TraitTemplate,
                  typename Base>
         auto to_trait(Base &&value) {
             return to_trait<TraitTemplate<Base>>(std::forward<Base>(value));
         }
 
+#if TRAIT_PROFILE
+        // Merged counters of one trait impl: calls and cycles of a method
+        // recorded by TRAIT_PROFILE_SCOPE, or allocations and frees of
+        // owning trait objects when method is empty
+        struct ProfileEntry {
+            const char *trait;
+            const char *base;
+            const char *method;
+            std::uint64_t calls;
+            std::uint64_t cycles;
+            std::uint64_t allocations;
+            std::uint64_t frees;
+        };
+
+        // Per-thread counters indexed by site, a site being one method of one
+        // impl or the allocations of one (Trait, Base). Each thread writes
+        // only its own counters without atomic read-modify-write; snapshots
+        // read them concurrently, and a thread merges them into the retired
+        // totals when it exits
+        struct __Profile final {
+            struct __Counters {
+                std::atomic<std::uint64_t> calls;
+                std::atomic<std::uint64_t> cycles;
+                std::atomic<std::uint64_t> allocations;
+                std::atomic<std::uint64_t> frees;
+            };
+
+            struct __Totals {
+                std::uint64_t calls = 0;
+                std::uint64_t cycles = 0;
+                std::uint64_t allocations = 0;
+                std::uint64_t frees = 0;
+            };
+
+            struct __Site {
+                std::string trait;
+                std::string base;
+                const char *method;
+            };
+
+            constexpr static std::size_t chunk_size = 256;
+            constexpr static std::size_t max_chunks = 256;
+
+            struct __Thread {
+                std::atomic<__Counters*> chunks[max_chunks] = {};
+
+                __Thread() = default;
+                __Thread(__Thread&) = delete;
+                __Thread &operator=(__Thread&) = delete;
+                ~__Thread() {
+                    for (auto &chunk : chunks) {
+                        delete[] chunk.load(std::memory_order_relaxed);
+                    }
+                }
+
+                __Counters &at(std::size_t site) {
+                    if (site >= chunk_size * max_chunks) {
+                        std::terminate();
+                    }
+                    std::atomic<__Counters*> &slot = chunks[site / chunk_size];
+                    __Counters *chunk = slot.load(std::memory_order_relaxed);
+                    if (!chunk) {
+                        chunk = new __Counters[chunk_size]();
+                        slot.store(chunk, std::memory_order_release);
+                    }
+                    return chunk[site % chunk_size];
+                }
+
+                void add_to(std::vector<__Totals> &totals) const {
+                    for (std::size_t site = 0; site < totals.size(); site++) {
+                        const __Counters *chunk = chunks[site / chunk_size].load(std::memory_order_acquire);
+                        if (chunk) {
+                            const __Counters &counters = chunk[site % chunk_size];
+                            totals[site].calls += counters.calls.load(std::memory_order_relaxed);
+                            totals[site].cycles += counters.cycles.load(std::memory_order_relaxed);
+                            totals[site].allocations += counters.allocations.load(std::memory_order_relaxed);
+                            totals[site].frees += counters.frees.load(std::memory_order_relaxed);
+                        }
+                    }
+                }
+            };
+
+            // Never destroyed, threads may record after static destruction
+            struct __Global {
+                std::mutex mutex;
+                std::vector<std::unique_ptr<__Site>> sites;
+                std::vector<__Thread*> threads;
+                std::vector<__Totals> retired;
+                std::vector<__Totals> baseline;
+                // Used by a thread after its own counters are retired, from
+                // thread_local destructors; concurrent updates may get lost
+                __Thread orphan;
+            };
+
+            struct __Local {
+                __Thread *thread;
+                __Local() : thread(new __Thread) {
+                    __Global &global = __global();
+                    std::lock_guard<std::mutex> lock(global.mutex);
+                    global.threads.push_back(thread);
+                }
+                ~__Local() {
+                    __Global &global = __global();
+                    {
+                        std::lock_guard<std::mutex> lock(global.mutex);
+                        global.retired.resize(global.sites.size());
+                        thread->add_to(global.retired);
+                        global.threads.erase(std::find(global.threads.begin(), global.threads.end(), thread));
+                    }
+                    __alive() = false;
+                    delete thread;
+                }
+            };
+
+            static __Global &__global() {
+                static __Global *global = new __Global;
+                return *global;
+            }
+
+            static bool &__alive() noexcept {
+                thread_local bool alive = true;
+                return alive;
+            }
+
+            static __Counters &counters(std::size_t site) {
+                if (!__alive()) {
+                    return __global().orphan.at(site);
+                }
+                thread_local __Local local;
+                return local.thread->at(site);
+            }
+
+            static void add(std::atomic<std::uint64_t> &counter, std::uint64_t value) noexcept {
+                counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+            }
+
+            static std::uint64_t clock() noexcept {
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+                return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+                std::uint64_t value;
+                asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+                return value;
+#else
+                return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+            }
+
+            // Type name taken from the signature of this function, without RTTI
+            template<class Type>
+            static std::string type_name() {
+#if defined(_MSC_VER) && !defined(__clang__)
+                std::string signature = __FUNCSIG__;
+                std::string::size_type begin = signature.find("type_name<");
+                std::string::size_type end = signature.rfind(">(void)");
+                if (begin == std::string::npos || end == std::string::npos) {
+                    return signature;
+                }
+                begin += 10;
+#else
+                std::string signature = __PRETTY_FUNCTION__;
+                std::string::size_type begin = signature.find("Type = ");
+                std::string::size_type end = signature.find_first_of(";]", begin);
+                if (begin == std::string::npos || end == std::string::npos) {
+                    return signature;
+                }
+                begin += 7;
+#endif
+                return signature.substr(begin, end - begin);
+            }
+
+            template<class Trait, class Base>
+            static std::size_t site(const char *method) {
+                std::unique_ptr<__Site> site{new __Site{type_name<Trait>(), type_name<Base>(), method}};
+                __Global &global = __global();
+                std::lock_guard<std::mutex> lock(global.mutex);
+                global.sites.push_back(std::move(site));
+                return global.sites.size() - 1;
+            }
+
+            template<class Trait, class Base>
+            static std::size_t allocation_site() {
+                static const std::size_t index = site<Trait, Base>("");
+                return index;
+            }
+
+            template<class Trait, class Base>
+            static void allocated() {
+                add(counters(allocation_site<Trait, Base>()).allocations, 1);
+            }
+
+            template<class Trait, class Base>
+            static void freed() noexcept {
+                add(counters(allocation_site<Trait, Base>()).frees, 1);
+            }
+
+            static std::vector<__Totals> __totals(__Global &global) {
+                std::vector<__Totals> totals = global.retired;
+                totals.resize(global.sites.size());
+                for (__Thread *thread : global.threads) {
+                    thread->add_to(totals);
+                }
+                global.orphan.add_to(totals);
+                return totals;
+            }
+        };
+
+        // Counts one call of the enclosing impl method, and its cycles when
+        // TRAIT_PROFILE_CYCLES is set
+        struct __ProfileScope final {
+            __Profile::__Counters &counters;
+#if TRAIT_PROFILE_CYCLES
+            std::uint64_t start;
+#endif
+            explicit __ProfileScope(std::size_t site) : counters(__Profile::counters(site)) {
+                __Profile::add(counters.calls, 1);
+#if TRAIT_PROFILE_CYCLES
+                start = __Profile::clock();
+#endif
+            }
+            __ProfileScope(__ProfileScope&) = delete;
+            __ProfileScope &operator=(__ProfileScope&) = delete;
+            ~__ProfileScope() {
+#if TRAIT_PROFILE_CYCLES
+                __Profile::add(counters.cycles, __Profile::clock() - start);
+#endif
+            }
+        };
+
+        template<class TraitImpl>
+        std::size_t __profile_site(const char *method) {
+            return __Profile::site<typename TraitImpl::__Trait, typename TraitImpl::__Self>(method);
+        }
+
+        template<class Trait, class Base>
+        void __profile_allocated() {
+            __Profile::allocated<Trait, Base>();
+        }
+
+        template<class Trait, class Base>
+        void __profile_freed() noexcept {
+            __Profile::freed<Trait, Base>();
+        }
+
+        // Counters of all threads merged by (trait, base, method) since the
+        // last profile_reset, skipping sites that recorded nothing
+        inline std::vector<ProfileEntry> profile_snapshot() {
+            __Profile::__Global &global = __Profile::__global();
+            std::lock_guard<std::mutex> lock(global.mutex);
+            std::vector<__Profile::__Totals> totals = __Profile::__totals(global);
+            std::vector<ProfileEntry> entries;
+            for (std::size_t site = 0; site < totals.size(); site++) {
+                __Profile::__Totals value = totals[site];
+                if (site < global.baseline.size()) {
+                    value.calls -= global.baseline[site].calls;
+                    value.cycles -= global.baseline[site].cycles;
+                    value.allocations -= global.baseline[site].allocations;
+                    value.frees -= global.baseline[site].frees;
+                }
+                if (!value.calls && !value.allocations && !value.frees) {
+                    continue;
+                }
+                const __Profile::__Site &info = *global.sites[site];
+                entries.push_back(ProfileEntry{info.trait.c_str(), info.base.c_str(), info.method,
+                                               value.calls, value.cycles, value.allocations, value.frees});
+            }
+            auto key = [](const ProfileEntry &entry) {
+                return std::make_tuple(std::string(entry.trait), std::string(entry.base), std::string(entry.method));
+            };
+            std::sort(entries.begin(), entries.end(), [&key](const ProfileEntry &a, const ProfileEntry &b) {
+                return key(a) < key(b);
+            });
+            // The same impl registers one site per shared library using it
+            std::vector<ProfileEntry> merged;
+            for (const ProfileEntry &entry : entries) {
+                if (!merged.empty() && key(merged.back()) == key(entry)) {
+                    merged.back().calls += entry.calls;
+                    merged.back().cycles += entry.cycles;
+                    merged.back().allocations += entry.allocations;
+                    merged.back().frees += entry.frees;
+                } else {
+                    merged.push_back(entry);
+                }
+            }
+            return merged;
+        }
+
+        // Following snapshots only count what happens after this call
+        inline void profile_reset() {
+            __Profile::__Global &global = __Profile::__global();
+            std::lock_guard<std::mutex> lock(global.mutex);
+            global.baseline = __Profile::__totals(global);
+        }
+
+        // Writes profile_snapshot() as one JSON object per line
+        inline void profile_dump(std::ostream &out) {
+            auto quote = [&out](const char *text) {
+                out << '"';
+                for (; *text; text++) {
+                    if (*text == '"' || *text == '\\') {
+                        out << '\\';
+                    }
+                    out << *text;
+                }
+                out << '"';
+            };
+            for (const ProfileEntry &entry : profile_snapshot()) {
+                out << "{\"trait\": ";
+                quote(entry.trait);
+                out << ", \"base\": ";
+                quote(entry.base);
+                out << ", \"method\": ";
+                quote(entry.method);
+                out << ", \"calls\": " << entry.calls << ", \"cycles\": " << entry.cycles
+                    << ", \"allocations\": " << entry.allocations << ", \"frees\": " << entry.frees << "}\n";
+            }
+        }
+#else
+        template<class Trait, class Base>
+        void __profile_allocated() noexcept {}
+
+        template<class Trait, class Base>
+        void __profile_freed() noexcept {}
+#endif
+
+        // Copy operations of one (Trait, Base): clone allocates a separate
+        // object, construct copies into a buffer of size bytes (0 when the
+        // object is over-aligned) that destroy tears down again
+        template<class Trait>
+        struct __TraitCloneEntry {
+            std::size_t size = 0;
+            TraitUPtr<Trait> (*clone)(Trait &trait) = nullptr;
+            Trait *(*construct)(void *buffer, Trait &trait) = nullptr;
+            void (*destroy)(Trait *trait) = nullptr;
+        };
+
+        // Operations of one kind of owned object. drop destructs and frees
+        // it, clone is null when TraitClone<Base> is false or copying Base
+        // may slice the object
+        template<class Trait>
+        struct __TraitUPtrOps {
+            void (*drop)(Trait *trait);
+            const __TraitCloneEntry<Trait> *clone;
+        };
+
+        // Header placed in front of the TraitImpl of every object made for
+        // a TraitUPtr, wherever it is allocated. Their TraitUPtr all share
+        // deleter, which finds the operations of the object in the header,
+        // so clone recognizes them by the deleter without a lookup by type
+        template<class Trait>
+        struct __TraitUPtrHeader {
+            const __TraitUPtrOps<Trait> *ops;
+
+            static __TraitUPtrHeader *of(Trait *trait) noexcept {
+                return reinterpret_cast<__TraitUPtrHeader*>(trait) - 1;
+            }
+
+            static void deleter(Trait *trait) {
+                of(trait)->ops->drop(trait);
+            }
+        };
+
+        template<class Trait, class Base>
+        constexpr const __TraitCloneEntry<Trait> *__clone_entry_of(std::true_type);
+
+        template<class Trait, class Base>
+        constexpr const __TraitCloneEntry<Trait> *__clone_entry_of(std::false_type) {
+            return nullptr;
+        }
+
+        // Objects wrapping these in another allocation replace header.ops
+        // with operations of their own after construction
         template<class Trait_, class Base_>
         struct TraitUPtrDirect final {
             using Trait = typename is_trait_h<Base_, Trait_>::Trait;
@@ -222,28 +1050,47 @@ namespace trait {
                           "cannot accept a non-standard trait: not trivially destructible");
             static_assert(std::is_nothrow_constructible<TraitImpl, Base&>::value,
                           "cannot accept a non-standard trait: not trivially constructible");
+            static_assert(sizeof(__TraitUPtrHeader<Trait>) % alignof(TraitImpl) == 0,
+                          "trait object must directly follow the header");
+            constexpr static bool clonable = TraitClone<Base>::value;
+            __TraitUPtrHeader<Trait> header;
             alignas(TraitImpl) char trait_buffer[sizeof(TraitImpl)];
             alignas(Base) char base_buffer[sizeof(Base)];
             template<class ...Args>
             TraitUPtrDirect(Args&& ...args) {
                 new(base_buffer) Base{std::forward<Args>(args)...};
                 new(trait_buffer) TraitImpl{*reinterpret_cast<Base*>(base_buffer)};
+                header.ops = &ops;
+                __profile_allocated<Trait, Base>();
             }
             ~TraitUPtrDirect() {
                 reinterpret_cast<TraitImpl*>(trait_buffer)->~TraitImpl();
                 reinterpret_cast<Base*>(base_buffer)->~Base();
+                __profile_freed<Trait, Base>();
             }
             TraitUPtrDirect(TraitUPtrDirect&) = delete;
             TraitUPtrDirect(TraitUPtrDirect&&) = delete;
             TraitUPtrDirect& operator=(TraitUPtrDirect&) = delete;
             TraitUPtrDirect& operator=(TraitUPtrDirect&&) = delete;
+            Trait *trait() noexcept {
+                return reinterpret_cast<Trait*>(trait_buffer);
+            }
+            static TraitUPtrDirect *of(Trait *trait) noexcept {
+                return reinterpret_cast<TraitUPtrDirect*>(__TraitUPtrHeader<Trait>::of(trait));
+            }
             template<class ...Args>
             static Trait* make(Args&& ...args) {
-                return reinterpret_cast<Trait*>(new TraitUPtrDirect{std::forward<Args>(args)...});
+                return (new TraitUPtrDirect{std::forward<Args>(args)...})->trait();
             }
-            static void deleter(Trait *trait) {
-                delete reinterpret_cast<TraitUPtrDirect*>(trait);
+            static void drop(Trait *trait) {
+                delete of(trait);
             }
+            static const __TraitUPtrOps<Trait> ops;
+        };
+
+        template<class Trait_, class Base_>
+        const __TraitUPtrOps<typename TraitUPtrDirect<Trait_, Base_>::Trait> TraitUPtrDirect<Trait_, Base_>::ops{
+            drop, __clone_entry_of<Trait, Base>(std::integral_constant<bool, clonable>())
         };
 
         template<class Trait_, class Base_, class Deleter>
@@ -255,33 +1102,88 @@ namespace trait {
                           "cannot accept a non-standard trait: size/alignment not match");
             static_assert(std::is_trivially_destructible<TraitImpl>::value,
                           "cannot accept a non-standard trait: not trivially destructible");
+            static_assert(sizeof(__TraitUPtrHeader<Trait>) % alignof(TraitImpl) == 0,
+                          "trait object must directly follow the header");
+            // The unique_ptr may point to a class derived from a polymorphic
+            // Base, which copying Base would slice
+            constexpr static bool clonable = TraitClone<Base>::value && !std::is_polymorphic<Base>::value;
+            __TraitUPtrHeader<Trait> header;
             alignas(TraitImpl) char trait_buffer[sizeof(TraitImpl)];
             alignas(std::unique_ptr<Base, Deleter>) char base_buffer[sizeof(std::unique_ptr<Base, Deleter>)];
             TraitUPtrUPtr(std::unique_ptr<Base, Deleter> &&value) {
                 new (base_buffer) std::unique_ptr<Base, Deleter>(std::move(value));
                 new (trait_buffer) TraitImpl{**reinterpret_cast<std::unique_ptr<Base, Deleter>*>(base_buffer)};
+                header.ops = &ops;
+                __profile_allocated<Trait, Base>();
             }
             ~TraitUPtrUPtr() {
                 reinterpret_cast<TraitImpl*>(trait_buffer)->~TraitImpl();
                 reinterpret_cast<std::unique_ptr<Base, Deleter>*>(base_buffer)->~unique_ptr();
+                __profile_freed<Trait, Base>();
             }
             TraitUPtrUPtr(TraitUPtrUPtr&) = delete;
             TraitUPtrUPtr(TraitUPtrUPtr&&) = delete;
             TraitUPtrUPtr& operator=(TraitUPtrUPtr&) = delete;
             TraitUPtrUPtr& operator=(TraitUPtrUPtr&&) = delete;
+            Trait *trait() noexcept {
+                return reinterpret_cast<Trait*>(trait_buffer);
+            }
+            static TraitUPtrUPtr *of(Trait *trait) noexcept {
+                return reinterpret_cast<TraitUPtrUPtr*>(__TraitUPtrHeader<Trait>::of(trait));
+            }
             static Trait* make(std::unique_ptr<Base, Deleter> &&value) {
-                return reinterpret_cast<Trait*>(new TraitUPtrUPtr{std::move(value)});
+                return (new TraitUPtrUPtr{std::move(value)})->trait();
             }
-            static void deleter(Trait *trait) {
-                delete reinterpret_cast<TraitUPtrUPtr*>(trait);
+            static void drop(Trait *trait) {
+                delete of(trait);
+            }
+            static const __TraitUPtrOps<Trait> ops;
+        };
+
+        template<class Trait_, class Base_, class Deleter>
+        const __TraitUPtrOps<typename TraitUPtrUPtr<Trait_, Base_, Deleter>::Trait> TraitUPtrUPtr<Trait_, Base_, Deleter>::ops{
+            drop, __clone_entry_of<Trait, Base>(std::integral_constant<bool, clonable>())
+        };
+
+        // Copies of a Base, allocated like trait::make or constructed into
+        // a buffer by clone_all
+        template<class Trait, class Base>
+        struct __TraitCloneOps {
+            using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+            using Copy = TraitUPtrDirect<Trait, Base>;
+
+            static Base &__base(Trait &trait) noexcept {
+                return static_cast<Base&>(static_cast<TraitImpl&>(trait).self);
+            }
+            static TraitUPtr<Trait> clone(Trait &trait) {
+                return TraitUPtr<Trait>{Copy::make(__base(trait)), __TraitUPtrHeader<Trait>::deleter};
+            }
+            static Trait *construct(void *buffer, Trait &trait) {
+                return (new(buffer) Copy{__base(trait)})->trait();
             }
+            static void destroy(Trait *trait) {
+                Copy::of(trait)->~Copy();
+            }
+
+            constexpr static std::size_t align = alignof(std::max_align_t);
+            static const __TraitCloneEntry<Trait> entry;
+        };
+
+        template<class Trait, class Base>
+        const __TraitCloneEntry<Trait> __TraitCloneOps<Trait, Base>::entry{
+            alignof(Copy) <= align ? (sizeof(Copy) + align - 1) / align * align : 0, clone, construct, destroy
         };
 
+        template<class Trait, class Base>
+        constexpr const __TraitCloneEntry<Trait> *__clone_entry_of(std::true_type) {
+            return &__TraitCloneOps<Trait, Base>::entry;
+        }
+
         template<class Trait, class Base>
         TraitUPtr<Trait> own(Base &&value) {
             static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
             using UPtr=TraitUPtrDirect<Trait, Base>;
-            return TraitUPtr<Trait>{UPtr::make(std::forward<Base>(value)), UPtr::deleter};
+            return TraitUPtr<Trait>{UPtr::make(std::forward<Base>(value)), __TraitUPtrHeader<Trait>::deleter};
         }
 
         template<class Trait, class Base, class Deleter>
@@ -290,41 +1192,3519 @@ namespace trait {
                           TraitUPtr<Trait>> own(std::unique_ptr<Base, Deleter> &&value) {
             static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
             using UPtr=TraitUPtrUPtr<Trait, Base, Deleter>;
-            return TraitUPtr<Trait>{UPtr::make(std::move(value)), UPtr::deleter};
+            return TraitUPtr<Trait>{UPtr::make(std::move(value)), __TraitUPtrHeader<Trait>::deleter};
         }
 
         template<class Trait, class Base, class ...Args>
         TraitUPtr<Trait> make(Args &&...args) {
             static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
             using UPtr=TraitUPtrDirect<Trait, Base>;
-            return TraitUPtr<Trait>{UPtr::make(std::forward<Args>(args)...), UPtr::deleter};
+            return TraitUPtr<Trait>{UPtr::make(std::forward<Args>(args)...), __TraitUPtrHeader<Trait>::deleter};
         }
-    }
-    using __impl::is_trait;
-    using __impl::to_trait;
-    using __impl::cast;
-    using __impl::TraitRef;
-    using __impl::TraitUPtr;
-    using __impl::own;
-    using __impl::make;
-    using __impl::trait_assert;
-    using __impl::is_trait_h;
-}
 
-template<typename Base, typename Trait, typename R, typename ...Args,
-         typename __assert=trait::trait_assert<Base, Trait>>
-auto operator->*(Base &&base, R (Trait::*ptr)(Args...)) {
-    return [&base, ptr](Args &&...args)->decltype(auto) {
-        return (trait::to_trait<Trait>(std::forward<Base>(base)).*ptr)(std::forward<Args>(args)...);
-    };
-}
+        inline void __shared_increment(std::size_t &count) noexcept {
+            ++count;
+        }
 
-template<class Trait, class Self, class ...RequiredTraits>
-struct __TraitImpl final: public trait::__impl::__TraitImplBase<Trait, Self> {
-    using __noimpl = decltype(Trait());
-};
+        inline void __shared_increment(std::atomic<std::size_t> &count) noexcept {
+            count.fetch_add(1, std::memory_order_relaxed);
+        }
 
-#define TRAIT_COMMA ,
+        inline bool __shared_increment_nonzero(std::size_t &count) noexcept {
+            if (!count) {
+                return false;
+            }
+            ++count;
+            return true;
+        }
+
+        inline bool __shared_increment_nonzero(std::atomic<std::size_t> &count) noexcept {
+            std::size_t current = count.load(std::memory_order_relaxed);
+            while (current) {
+                if (count.compare_exchange_weak(current, current + 1,
+                                                std::memory_order_acquire, std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Returns true when the last reference is released
+        inline bool __shared_decrement(std::size_t &count) noexcept {
+            return --count == 0;
+        }
+
+        inline bool __shared_decrement(std::atomic<std::size_t> &count) noexcept {
+            if (count.fetch_sub(1, std::memory_order_release) == 1) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return true;
+            }
+            return false;
+        }
+
+        inline std::size_t __shared_load(const std::size_t &count) noexcept {
+            return count;
+        }
+
+        inline std::size_t __shared_load(const std::atomic<std::size_t> &count) noexcept {
+            return count.load(std::memory_order_relaxed);
+        }
+
+        // Objects copied by clone_all share one allocation. Every object is
+        // preceded by a slot pointing to the batch and to its entry, the
+        // batch is freed together with its last object
+        template<class Trait>
+        struct __TraitCloneBatch final {
+            struct __Slot {
+                __TraitCloneBatch *batch;
+                const __TraitCloneEntry<Trait> *entry;
+            };
+
+            constexpr static std::size_t __round(std::size_t size) {
+                return (size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+            }
+            constexpr static std::size_t offset = __round(sizeof(__Slot));
+
+            std::atomic<std::size_t> count;
+
+            static __Slot *slot(Trait *trait) noexcept {
+                return reinterpret_cast<__Slot*>(reinterpret_cast<char*>(__TraitUPtrHeader<Trait>::of(trait)) - offset);
+            }
+
+            static void release(__TraitCloneBatch *batch) noexcept {
+                if (__shared_decrement(batch->count)) {
+                    batch->~__TraitCloneBatch();
+                    ::operator delete(batch);
+                }
+            }
+
+            static void deleter(Trait *trait) {
+                __Slot *item = slot(trait);
+                __TraitCloneBatch *batch = item->batch;
+                item->entry->destroy(trait);
+                release(batch);
+            }
+        };
+
+        // Objects made by this library, also the copies of clone_all, carry
+        // a header; the deleter of any other TraitUPtr may be anything
+        template<class Trait>
+        const __TraitCloneEntry<Trait> *__clone_entry(const TraitUPtr<Trait> &ptr) noexcept {
+            using Deleter = void(*)(Trait*);
+            if (ptr.get_deleter() == static_cast<Deleter>(__TraitUPtrHeader<Trait>::deleter) ||
+                ptr.get_deleter() == static_cast<Deleter>(__TraitCloneBatch<Trait>::deleter)) {
+                return __TraitUPtrHeader<Trait>::of(ptr.get())->ops->clone;
+            }
+            return nullptr;
+        }
+
+        // Deep copy of the object behind ptr, allocated like trait::make.
+        // Empty when ptr is empty, was not made by this library or
+        // TraitClone<Base> is false
+        template<class Trait>
+        TraitUPtr<Trait> clone(const TraitUPtr<Trait> &ptr) {
+            const __TraitCloneEntry<Trait> *entry = ptr ? __clone_entry(ptr) : nullptr;
+            return entry ? entry->clone(*ptr) : TraitUPtr<Trait>{nullptr, nullptr};
+        }
+
+        template<class T>
+        struct __TraitUPtrTest {};
+
+        template<class Trait_>
+        struct __TraitUPtrTest<TraitUPtr<Trait_>> {
+            using Trait = Trait_;
+        };
+
+        // clone of every element of a range of TraitUPtr, in order. The
+        // copies are constructed into a single allocation sized for the
+        // whole batch, only over-aligned types are allocated one by one
+        template<class Range,
+                 class Trait=typename __TraitUPtrTest<std::decay_t<decltype(*std::begin(std::declval<Range&>()))>>::Trait>
+        std::vector<TraitUPtr<Trait>> clone_all(const Range &range) {
+            using Entry = __TraitCloneEntry<Trait>;
+            using Batch = __TraitCloneBatch<Trait>;
+            std::vector<const Entry*> entries;
+            std::size_t size = Batch::__round(sizeof(Batch));
+            for (auto &ptr : range) {
+                const Entry *entry = ptr ? __clone_entry(ptr) : nullptr;
+                entries.push_back(entry);
+                if (entry && entry->size) {
+                    size += Batch::offset + entry->size;
+                }
+            }
+            std::vector<TraitUPtr<Trait>> result;
+            result.reserve(entries.size());
+            if (size == Batch::__round(sizeof(Batch))) {
+                for (auto &ptr : range) {
+                    const Entry *entry = entries[result.size()];
+                    result.push_back(entry ? entry->clone(*ptr) : TraitUPtr<Trait>{nullptr, nullptr});
+                }
+                return result;
+            }
+            // Holds a reference of its own until every copy is made, so an
+            // exception from a copy constructor frees the batch with result
+            std::unique_ptr<Batch, void(*)(Batch*)> batch{new(::operator new(size)) Batch{{1}}, Batch::release};
+            char *cursor = reinterpret_cast<char*>(batch.get()) + Batch::__round(sizeof(Batch));
+            for (auto &ptr : range) {
+                const Entry *entry = entries[result.size()];
+                if (!entry) {
+                    result.push_back(TraitUPtr<Trait>{nullptr, nullptr});
+                } else if (!entry->size) {
+                    result.push_back(entry->clone(*ptr));
+                } else {
+                    new(cursor) typename Batch::__Slot{batch.get(), entry};
+                    Trait *copy = entry->construct(cursor + Batch::offset, *ptr);
+                    __shared_increment(batch->count);
+                    result.push_back(TraitUPtr<Trait>{copy, Batch::deleter});
+                    cursor += Batch::offset + entry->size;
+                }
+            }
+            return result;
+        }
+
+        // Control block placed in front of the TraitImpl in a shared trait
+        // object. All strong references together hold one weak reference.
+        // manager(control, false) destructs Base, manager(control, true)
+        // frees the allocation
+        template<bool Atomic>
+        struct __TraitSharedControl {
+            using Counter = std::conditional_t<Atomic, std::atomic<std::size_t>, std::size_t>;
+            Counter strong{1};
+            Counter weak{1};
+            void (*manager)(__TraitSharedControl*, bool);
+        };
+
+        template<class Trait_, class Base_, bool Atomic>
+        struct TraitSharedDirect final {
+            using Trait = typename is_trait_h<Base_, Trait_>::Trait;
+            using Base = typename is_trait_h<Base_, Trait_>::Base;
+            using TraitImpl = typename is_trait_h<Base_, Trait_>::TraitImpl;
+            using Control = __TraitSharedControl<Atomic>;
+            static_assert(sizeof(TraitImpl) == sizeof(TraitRef<Trait>) && alignof(TraitImpl) == alignof(TraitRef<Trait>),
+                          "cannot accept a non-standard trait: size/alignment not match");
+            static_assert(std::is_trivially_destructible<TraitImpl>::value,
+                          "cannot accept a non-standard trait: not trivially destructible");
+            static_assert(sizeof(Control) % alignof(TraitImpl) == 0,
+                          "trait object must directly follow the control block");
+            Control control;
+            alignas(TraitImpl) char trait_buffer[sizeof(TraitImpl)];
+            alignas(Base) char base_buffer[sizeof(Base)];
+            template<class ...Args>
+            TraitSharedDirect(Args&& ...args) {
+                new(base_buffer) Base{std::forward<Args>(args)...};
+                new(trait_buffer) TraitImpl{*reinterpret_cast<Base*>(base_buffer)};
+                control.manager = manager;
+                __profile_allocated<Trait, Base>();
+            }
+            TraitSharedDirect(TraitSharedDirect&) = delete;
+            TraitSharedDirect(TraitSharedDirect&&) = delete;
+            TraitSharedDirect& operator=(TraitSharedDirect&) = delete;
+            TraitSharedDirect& operator=(TraitSharedDirect&&) = delete;
+            template<class ...Args>
+            static Control* make(Args&& ...args) {
+                return &(new TraitSharedDirect{std::forward<Args>(args)...})->control;
+            }
+            static void manager(Control *control, bool deallocate) {
+                TraitSharedDirect *ptr = reinterpret_cast<TraitSharedDirect*>(control);
+                if (deallocate) {
+                    delete ptr;
+                    __profile_freed<Trait, Base>();
+                } else {
+                    reinterpret_cast<TraitImpl*>(ptr->trait_buffer)->~TraitImpl();
+                    reinterpret_cast<Base*>(ptr->base_buffer)->~Base();
+                }
+            }
+        };
+
+        template<class Trait, bool Atomic = true>
+        struct TraitWeak;
+
+        // Shared owning trait object: one allocation holds the reference
+        // counts, the TraitImpl and Base, like TraitUPtrDirect
+        template<class Trait, bool Atomic>
+        struct TraitShared final {
+            using Control = __TraitSharedControl<Atomic>;
+            Control *control = nullptr;
+
+            TraitShared() = default;
+            explicit TraitShared(Control *control_) noexcept : control(control_) {}
+            TraitShared(const TraitShared &other) noexcept : control(other.control) {
+                if (control) {
+                    __shared_increment(control->strong);
+                }
+            }
+            TraitShared(TraitShared &&other) noexcept : control(other.control) {
+                other.control = nullptr;
+            }
+            TraitShared &operator=(const TraitShared &other) noexcept {
+                TraitShared(other).swap(*this);
+                return *this;
+            }
+            TraitShared &operator=(TraitShared &&other) noexcept {
+                TraitShared(std::move(other)).swap(*this);
+                return *this;
+            }
+            ~TraitShared() {
+                reset();
+            }
+
+            void swap(TraitShared &other) noexcept {
+                std::swap(control, other.control);
+            }
+
+            void reset() noexcept {
+                if (control) {
+                    if (__shared_decrement(control->strong)) {
+                        control->manager(control, false);
+                        if (__shared_decrement(control->weak)) {
+                            control->manager(control, true);
+                        }
+                    }
+                    control = nullptr;
+                }
+            }
+
+            std::size_t use_count() const noexcept {
+                return control ? __shared_load(control->strong) : 0;
+            }
+
+            TraitWeak<Trait, Atomic> downgrade() const noexcept {
+                return TraitWeak<Trait, Atomic>{*this};
+            }
+
+            explicit operator bool() const noexcept {
+                return control != nullptr;
+            }
+            Trait* get() const noexcept {
+                return control ? reinterpret_cast<Trait*>(control + 1) : nullptr;
+            }
+            Trait& operator*() const noexcept {
+                return *reinterpret_cast<Trait*>(control + 1);
+            }
+            Trait* operator->() const noexcept {
+                return reinterpret_cast<Trait*>(control + 1);
+            }
+
+            template<class Base>
+            Base &cast() const {
+                return trait::__impl::cast<Base>(**this);
+            }
+
+            template<class Base>
+            Base *try_cast() const {
+                return control ? trait::__impl::try_cast<Base>(**this) : nullptr;
+            }
+
+            TraitTypeId type_id() const {
+                return control ? trait::__impl::type_id(**this) : nullptr;
+            }
+        };
+
+        template<class Trait, bool Atomic>
+        struct TraitWeak final {
+            using Control = __TraitSharedControl<Atomic>;
+            Control *control = nullptr;
+
+            TraitWeak() = default;
+            explicit TraitWeak(const TraitShared<Trait, Atomic> &shared) noexcept : control(shared.control) {
+                if (control) {
+                    __shared_increment(control->weak);
+                }
+            }
+            TraitWeak(const TraitWeak &other) noexcept : control(other.control) {
+                if (control) {
+                    __shared_increment(control->weak);
+                }
+            }
+            TraitWeak(TraitWeak &&other) noexcept : control(other.control) {
+                other.control = nullptr;
+            }
+            TraitWeak &operator=(const TraitWeak &other) noexcept {
+                TraitWeak(other).swap(*this);
+                return *this;
+            }
+            TraitWeak &operator=(TraitWeak &&other) noexcept {
+                TraitWeak(std::move(other)).swap(*this);
+                return *this;
+            }
+            ~TraitWeak() {
+                reset();
+            }
+
+            void swap(TraitWeak &other) noexcept {
+                std::swap(control, other.control);
+            }
+
+            void reset() noexcept {
+                if (control) {
+                    if (__shared_decrement(control->weak)) {
+                        control->manager(control, true);
+                    }
+                    control = nullptr;
+                }
+            }
+
+            bool expired() const noexcept {
+                return !control || __shared_load(control->strong) == 0;
+            }
+
+            // Returns an empty TraitShared when the object is already destructed
+            TraitShared<Trait, Atomic> upgrade() const noexcept {
+                if (control && __shared_increment_nonzero(control->strong)) {
+                    return TraitShared<Trait, Atomic>{control};
+                }
+                return TraitShared<Trait, Atomic>{};
+            }
+        };
+
+        template<class Trait>
+        using TraitArc = TraitShared<Trait, true>;
+
+        template<class Trait>
+        using TraitRc = TraitShared<Trait, false>;
+
+        template<class Trait_, bool Atomic>
+        struct __TraitHandleTraits<TraitShared<Trait_, Atomic>> {
+            using Trait = Trait_;
+            static Trait &get(TraitShared<Trait, Atomic> &shared) {
+                return *shared;
+            }
+            // Like shared_ptr, a const handle still shares a mutable object
+            static Trait &get(const TraitShared<Trait, Atomic> &shared) {
+                return *shared;
+            }
+        };
+
+        template<class Trait_, bool Atomic>
+        struct __TraitHandleTraits<const TraitShared<Trait_, Atomic>> : __TraitHandleTraits<TraitShared<Trait_, Atomic>> {};
+
+        template<class Trait, class Base>
+        TraitArc<Trait> own_arc(Base &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using Shared=TraitSharedDirect<Trait, Base, true>;
+            return TraitArc<Trait>{Shared::make(std::forward<Base>(value))};
+        }
+
+        template<class Trait, class Base, class ...Args>
+        TraitArc<Trait> make_arc(Args &&...args) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using Shared=TraitSharedDirect<Trait, Base, true>;
+            return TraitArc<Trait>{Shared::make(std::forward<Args>(args)...)};
+        }
+
+        template<class Trait, class Base>
+        TraitRc<Trait> own_rc(Base &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using Shared=TraitSharedDirect<Trait, Base, false>;
+            return TraitRc<Trait>{Shared::make(std::forward<Base>(value))};
+        }
+
+        template<class Trait, class Base, class ...Args>
+        TraitRc<Trait> make_rc(Args &&...args) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using Shared=TraitSharedDirect<Trait, Base, false>;
+            return TraitRc<Trait>{Shared::make(std::forward<Args>(args)...)};
+        }
+
+        struct __TraitBoxHeader;
+
+        // Operations of one boxed type. drop destructs Base and frees the
+        // allocation, clone allocates a copy or is null when TraitClone<Base>
+        // is false
+        struct __TraitBoxOps {
+            void (*drop)(__TraitBoxHeader*);
+            __TraitBoxHeader *(*clone)(__TraitBoxHeader*);
+        };
+
+        // Header placed in front of the TraitImpl in a boxed trait object,
+        // so the handle does not have to carry a deleter
+        struct __TraitBoxHeader {
+            const __TraitBoxOps *ops;
+        };
+
+        template<class Trait_, class Base_>
+        struct TraitBoxDirect final {
+            using Trait = typename is_trait_h<Base_, Trait_>::Trait;
+            using Base = typename is_trait_h<Base_, Trait_>::Base;
+            using TraitImpl = typename is_trait_h<Base_, Trait_>::TraitImpl;
+            static_assert(sizeof(TraitImpl) == sizeof(TraitRef<Trait>) && alignof(TraitImpl) == alignof(TraitRef<Trait>),
+                          "cannot accept a non-standard trait: size/alignment not match");
+            static_assert(std::is_trivially_destructible<TraitImpl>::value,
+                          "cannot accept a non-standard trait: not trivially destructible");
+            static_assert(sizeof(__TraitBoxHeader) % alignof(TraitImpl) == 0,
+                          "trait object must directly follow the header");
+            __TraitBoxHeader header;
+            alignas(TraitImpl) char trait_buffer[sizeof(TraitImpl)];
+            alignas(Base) char base_buffer[sizeof(Base)];
+            template<class ...Args>
+            TraitBoxDirect(Args&& ...args) {
+                new(base_buffer) Base{std::forward<Args>(args)...};
+                new(trait_buffer) TraitImpl{*reinterpret_cast<Base*>(base_buffer)};
+                header.ops = &ops;
+                __profile_allocated<Trait, Base>();
+            }
+            ~TraitBoxDirect() {
+                reinterpret_cast<TraitImpl*>(trait_buffer)->~TraitImpl();
+                reinterpret_cast<Base*>(base_buffer)->~Base();
+                __profile_freed<Trait, Base>();
+            }
+            TraitBoxDirect(TraitBoxDirect&) = delete;
+            TraitBoxDirect(TraitBoxDirect&&) = delete;
+            TraitBoxDirect& operator=(TraitBoxDirect&) = delete;
+            TraitBoxDirect& operator=(TraitBoxDirect&&) = delete;
+            template<class ...Args>
+            static __TraitBoxHeader* make(Args&& ...args) {
+                return &(new TraitBoxDirect{std::forward<Args>(args)...})->header;
+            }
+            static void drop(__TraitBoxHeader *header) {
+                delete reinterpret_cast<TraitBoxDirect*>(header);
+            }
+            static const __TraitBoxOps ops;
+        };
+
+        // Copies the Base a boxed TraitImpl refers to into a new TraitBoxDirect
+        template<class Trait, class Base>
+        __TraitBoxHeader *__box_clone(__TraitBoxHeader *header) {
+            using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+            TraitImpl &impl = *reinterpret_cast<TraitImpl*>(header + 1);
+            return TraitBoxDirect<Trait, Base>::make(static_cast<Base&>(impl.self));
+        }
+
+        template<class Trait, class Base>
+        constexpr __TraitBoxHeader *(*__box_cloner(std::true_type))(__TraitBoxHeader*) {
+            return __box_clone<Trait, Base>;
+        }
+
+        template<class Trait, class Base>
+        constexpr __TraitBoxHeader *(*__box_cloner(std::false_type))(__TraitBoxHeader*) {
+            return nullptr;
+        }
+
+        template<class Trait_, class Base_>
+        const __TraitBoxOps TraitBoxDirect<Trait_, Base_>::ops{
+            drop, __box_cloner<Trait, Base>(TraitClone<Base>())
+        };
+
+        template<class Trait_, class Base_, class Deleter>
+        struct TraitBoxUPtr final {
+            using Trait = typename is_trait_h<Base_, Trait_>::Trait;
+            using Base = typename is_trait_h<Base_, Trait_>::Base;
+            using TraitImpl = typename is_trait_h<Base_, Trait_>::TraitImpl;
+            static_assert(sizeof(TraitImpl) == sizeof(TraitRef<Trait>) && alignof(TraitImpl) == alignof(TraitRef<Trait>),
+                          "cannot accept a non-standard trait: size/alignment not match");
+            static_assert(std::is_trivially_destructible<TraitImpl>::value,
+                          "cannot accept a non-standard trait: not trivially destructible");
+            static_assert(sizeof(__TraitBoxHeader) % alignof(TraitImpl) == 0,
+                          "trait object must directly follow the header");
+            __TraitBoxHeader header;
+            alignas(TraitImpl) char trait_buffer[sizeof(TraitImpl)];
+            std::unique_ptr<Base, Deleter> value;
+            TraitBoxUPtr(std::unique_ptr<Base, Deleter> &&value_) : value(std::move(value_)) {
+                new(trait_buffer) TraitImpl{*value};
+                header.ops = &ops;
+                __profile_allocated<Trait, Base>();
+            }
+            ~TraitBoxUPtr() {
+                reinterpret_cast<TraitImpl*>(trait_buffer)->~TraitImpl();
+                __profile_freed<Trait, Base>();
+            }
+            TraitBoxUPtr(TraitBoxUPtr&) = delete;
+            TraitBoxUPtr(TraitBoxUPtr&&) = delete;
+            TraitBoxUPtr& operator=(TraitBoxUPtr&) = delete;
+            TraitBoxUPtr& operator=(TraitBoxUPtr&&) = delete;
+            static __TraitBoxHeader* make(std::unique_ptr<Base, Deleter> &&value) {
+                return &(new TraitBoxUPtr{std::move(value)})->header;
+            }
+            static void drop(__TraitBoxHeader *header) {
+                delete reinterpret_cast<TraitBoxUPtr*>(header);
+            }
+            static const __TraitBoxOps ops;
+        };
+
+        // Like TraitUPtrUPtr, a polymorphic Base may be a slice of the object
+        template<class Trait_, class Base_, class Deleter>
+        const __TraitBoxOps TraitBoxUPtr<Trait_, Base_, Deleter>::ops{
+            drop, __box_cloner<Trait, Base>(std::integral_constant<bool, TraitClone<Base>::value &&
+                                                                         !std::is_polymorphic<Base>::value>())
+        };
+
+        // Owning trait object of one pointer: the destructor is found
+        // through the header of the allocation instead of a deleter stored
+        // in the handle, so TraitBox is half the size of TraitUPtr
+        template<class Trait>
+        struct TraitBox final {
+            __TraitBoxHeader *header = nullptr;
+
+            TraitBox() = default;
+            explicit TraitBox(__TraitBoxHeader *header_) noexcept : header(header_) {}
+            TraitBox(TraitBox &&other) noexcept : header(other.header) {
+                other.header = nullptr;
+            }
+            TraitBox &operator=(TraitBox &&other) noexcept {
+                TraitBox(std::move(other)).swap(*this);
+                return *this;
+            }
+            TraitBox(TraitBox&) = delete;
+            TraitBox& operator=(TraitBox&) = delete;
+            ~TraitBox() {
+                reset();
+            }
+
+            void swap(TraitBox &other) noexcept {
+                std::swap(header, other.header);
+            }
+
+            void reset() noexcept {
+                if (header) {
+                    header->ops->drop(header);
+                    header = nullptr;
+                }
+            }
+
+            explicit operator bool() const noexcept {
+                return header != nullptr;
+            }
+            Trait* get() const noexcept {
+                return header ? reinterpret_cast<Trait*>(header + 1) : nullptr;
+            }
+            Trait& operator*() const noexcept {
+                return *reinterpret_cast<Trait*>(header + 1);
+            }
+            Trait* operator->() const noexcept {
+                return reinterpret_cast<Trait*>(header + 1);
+            }
+
+            template<class Base>
+            Base &cast() const {
+                return trait::__impl::cast<Base>(**this);
+            }
+
+            template<class Base>
+            Base *try_cast() const {
+                return header ? trait::__impl::try_cast<Base>(**this) : nullptr;
+            }
+
+            TraitTypeId type_id() const {
+                return header ? trait::__impl::type_id(**this) : nullptr;
+            }
+        };
+
+        template<class Trait_>
+        struct __TraitHandleTraits<TraitBox<Trait_>> {
+            using Trait = Trait_;
+            static Trait &get(TraitBox<Trait> &box) {
+                return *box;
+            }
+            // Like unique_ptr, a const box still owns a mutable object
+            static Trait &get(const TraitBox<Trait> &box) {
+                return *box;
+            }
+        };
+
+        template<class Trait_>
+        struct __TraitHandleTraits<const TraitBox<Trait_>> : __TraitHandleTraits<TraitBox<Trait_>> {};
+
+        template<class Trait, class Base>
+        TraitBox<Trait> own_box(Base &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using Box=TraitBoxDirect<Trait, Base>;
+            return TraitBox<Trait>{Box::make(std::forward<Base>(value))};
+        }
+
+        template<class Trait, class Base, class Deleter>
+        std::enable_if_t<(is_trait_h<Base, Trait>::value ||
+                          !is_trait_h<std::unique_ptr<Base, Deleter>, Trait>::value),
+                          TraitBox<Trait>> own_box(std::unique_ptr<Base, Deleter> &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using Box=TraitBoxUPtr<Trait, Base, Deleter>;
+            return TraitBox<Trait>{Box::make(std::move(value))};
+        }
+
+        template<class Trait, class Base, class ...Args>
+        TraitBox<Trait> make_box(Args &&...args) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using Box=TraitBoxDirect<Trait, Base>;
+            return TraitBox<Trait>{Box::make(std::forward<Args>(args)...)};
+        }
+
+        // Deep copy of a boxed object. Empty when box is empty or
+        // TraitClone<Base> is false
+        template<class Trait>
+        TraitBox<Trait> clone(const TraitBox<Trait> &box) {
+            if (!box || !box.header->ops->clone) {
+                return TraitBox<Trait>{};
+            }
+            return TraitBox<Trait>{box.header->ops->clone(box.header)};
+        }
+
+        // Bump allocator over a list of blocks. deallocate only rewinds the
+        // most recent allocation; reset() reclaims everything at once
+        struct MonotonicArena final {
+            struct __Block {
+                __Block *next;
+                std::size_t size;
+            };
+            __Block *blocks = nullptr;
+            char *cursor = nullptr;
+            char *end = nullptr;
+            std::size_t block_size;
+
+            explicit MonotonicArena(std::size_t block_size_ = 4096) noexcept : block_size(block_size_) {}
+            MonotonicArena(MonotonicArena&) = delete;
+            MonotonicArena& operator=(MonotonicArena&) = delete;
+            ~MonotonicArena() {
+                while (blocks) {
+                    __Block *next = blocks->next;
+                    ::operator delete(blocks);
+                    blocks = next;
+                }
+            }
+
+            void *allocate(std::size_t size, std::size_t align) {
+                char *p = __align(cursor, align);
+                if (!cursor || p + size > end) {
+                    __grow(size + align);
+                    p = __align(cursor, align);
+                }
+                cursor = p + size;
+                return p;
+            }
+
+            void deallocate(void *p, std::size_t size, std::size_t) noexcept {
+                if (static_cast<char*>(p) + size == cursor) {
+                    cursor = static_cast<char*>(p);
+                }
+            }
+
+            // Keeps the current block and releases the others; objects that
+            // live in the arena are not destructed
+            void reset() noexcept {
+                if (!blocks) {
+                    return;
+                }
+                __Block *next = blocks->next;
+                while (next) {
+                    __Block *after = next->next;
+                    ::operator delete(next);
+                    next = after;
+                }
+                blocks->next = nullptr;
+                cursor = reinterpret_cast<char*>(blocks + 1);
+            }
+
+            static char *__align(char *p, std::size_t align) noexcept {
+                return reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(p) + align - 1) & ~(align - 1));
+            }
+
+            void __grow(std::size_t required) {
+                std::size_t size = required > block_size ? required : block_size;
+                __Block *block = static_cast<__Block*>(::operator new(sizeof(__Block) + size));
+                block->next = blocks;
+                block->size = size;
+                blocks = block;
+                cursor = reinterpret_cast<char*>(block + 1);
+                end = cursor + size;
+            }
+        };
+
+        // Per-size-class free lists carved out of a MonotonicArena. Sizes are
+        // rounded up to multiples of max_align_t; larger or over-aligned
+        // requests go to the global allocator. Not thread safe
+        struct PoolArena final {
+            constexpr static std::size_t granularity = alignof(std::max_align_t);
+            constexpr static std::size_t size_classes = 16;
+            MonotonicArena blocks;
+            void *free_lists[size_classes] = {};
+
+            explicit PoolArena(std::size_t block_size = 4096) noexcept : blocks(block_size) {}
+            PoolArena(PoolArena&) = delete;
+            PoolArena& operator=(PoolArena&) = delete;
+
+            void *allocate(std::size_t size, std::size_t align) {
+                if (size > size_classes * granularity || align > granularity) {
+                    return ::operator new(size);
+                }
+                std::size_t index = (size - 1) / granularity;
+                if (void *p = free_lists[index]) {
+                    free_lists[index] = *static_cast<void**>(p);
+                    return p;
+                }
+                return blocks.allocate((index + 1) * granularity, granularity);
+            }
+
+            void deallocate(void *p, std::size_t size, std::size_t align) noexcept {
+                if (size > size_classes * granularity || align > granularity) {
+                    ::operator delete(p);
+                    return;
+                }
+                std::size_t index = (size - 1) / granularity;
+                *static_cast<void**>(p) = free_lists[index];
+                free_lists[index] = p;
+            }
+        };
+
+        // Thread safe size-class pool shared by the whole process, for
+        // objects that are created and dropped at a high rate on many
+        // threads. Every thread caches free blocks per size class; a cache
+        // that reaches 2 * batch blocks returns batch of them to a lock-free
+        // global stack, and an empty cache takes a batch from that stack
+        // before carving new memory. A block freed on another thread goes to
+        // the cache of the freeing thread. Memory is kept by the pool and is
+        // never returned to the system. Sizes and alignments are handled
+        // like PoolArena
+        struct SharedPool final {
+            constexpr static std::size_t granularity = alignof(std::max_align_t);
+            constexpr static std::size_t size_classes = 16;
+            constexpr static std::size_t batch = 32;
+
+            // Blocks of a batch are linked through next; batches on the
+            // global stack are linked through next_batch of their first block
+            struct __Block {
+                __Block *next;
+                std::atomic<__Block*> next_batch;
+            };
+            static_assert(sizeof(__Block) <= granularity, "size class too small for a free block");
+
+            // Heads of the global stacks pack a pointer with a counter that
+            // changes on every update, so a pop cannot succeed on a head that
+            // was popped and pushed again in between (ABA). Pointers must
+            // fit in the low 48 bits, which user space addresses do unless
+            // a 5-level paging kernel is asked for higher ones; __take checks
+            constexpr static unsigned __tag_shift = sizeof(void*) == 8 ? 48 : 32;
+            constexpr static std::uint64_t __pointer_mask = (std::uint64_t(1) << __tag_shift) - 1;
+            static_assert(sizeof(std::uintptr_t) <= sizeof(std::uint64_t), "pointers wider than 64 bits");
+
+            struct __Cache {
+                __Block *heads[size_classes] = {};
+                std::size_t counts[size_classes] = {};
+                ~__Cache() {
+                    for (std::size_t index = 0; index < size_classes; index++) {
+                        if (heads[index]) {
+                            __push(index, heads[index]);
+                        }
+                    }
+                    __cache_alive() = false;
+                }
+            };
+
+            static void *allocate(std::size_t size, std::size_t align) {
+                if (size > size_classes * granularity || align > granularity) {
+                    return ::operator new(size);
+                }
+                std::size_t index = (size - 1) / granularity;
+                if (!__cache_alive()) {
+                    return __take(index, nullptr);
+                }
+                __Cache &cache = __cache();
+                __Block *block = cache.heads[index];
+                if (!block) {
+                    block = __take(index, &cache);
+                }
+                cache.heads[index] = block->next;
+                cache.counts[index]--;
+                return block;
+            }
+
+            static void deallocate(void *p, std::size_t size, std::size_t align) noexcept {
+                if (size > size_classes * granularity || align > granularity) {
+                    ::operator delete(p);
+                    return;
+                }
+                std::size_t index = (size - 1) / granularity;
+                __Block *block = static_cast<__Block*>(p);
+                if (!__cache_alive()) {
+                    block->next = nullptr;
+                    __push(index, block);
+                    return;
+                }
+                __Cache &cache = __cache();
+                block->next = cache.heads[index];
+                cache.heads[index] = block;
+                if (++cache.counts[index] >= 2 * batch) {
+                    __Block *last = block;
+                    for (std::size_t i = 1; i < batch; i++) {
+                        last = last->next;
+                    }
+                    cache.heads[index] = last->next;
+                    cache.counts[index] -= batch;
+                    last->next = nullptr;
+                    __push(index, block);
+                }
+            }
+
+            // Refills the cache of the calling thread, or returns a single
+            // block when the thread has already destroyed its cache
+            static __Block *__take(std::size_t index, __Cache *cache) {
+                __Block *first = __pop(index);
+                if (!first) {
+                    std::size_t size = (index + 1) * granularity;
+                    std::size_t count = cache ? batch : 1;
+                    char *memory = static_cast<char*>(::operator new(size * count));
+                    if (reinterpret_cast<std::uintptr_t>(memory + size * count - 1) > __pointer_mask) {
+                        std::terminate();
+                    }
+                    for (std::size_t i = 0; i < count; i++) {
+                        reinterpret_cast<__Block*>(memory + i * size)->next =
+                            i + 1 < count ? reinterpret_cast<__Block*>(memory + (i + 1) * size) : nullptr;
+                    }
+                    first = reinterpret_cast<__Block*>(memory);
+                }
+                if (!cache) {
+                    if (first->next) {
+                        __push(index, first->next);
+                    }
+                    return first;
+                }
+                std::size_t count = 0;
+                for (__Block *block = first; block; block = block->next) {
+                    count++;
+                }
+                cache->heads[index] = first;
+                cache->counts[index] = count;
+                return first;
+            }
+
+            static void __push(std::size_t index, __Block *first) noexcept {
+                std::atomic<std::uint64_t> &head = __heads()[index];
+                std::uint64_t old = head.load(std::memory_order_relaxed);
+                std::uint64_t next;
+                do {
+                    first->next_batch.store(reinterpret_cast<__Block*>(static_cast<std::uintptr_t>(old & __pointer_mask)),
+                                            std::memory_order_relaxed);
+                    next = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(first)) |
+                           ((old >> __tag_shift) + 1) << __tag_shift;
+                } while (!head.compare_exchange_weak(old, next, std::memory_order_release, std::memory_order_relaxed));
+            }
+
+            // next_batch of a batch that another thread has just popped may
+            // be stale, so it is atomic: the memory stays owned by the pool,
+            // and the tag makes the following compare_exchange fail
+            static __Block *__pop(std::size_t index) noexcept {
+                std::atomic<std::uint64_t> &head = __heads()[index];
+                std::uint64_t old = head.load(std::memory_order_acquire);
+                while (__Block *first = reinterpret_cast<__Block*>(static_cast<std::uintptr_t>(old & __pointer_mask))) {
+                    __Block *next_batch = first->next_batch.load(std::memory_order_relaxed);
+                    std::uint64_t next = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(next_batch)) |
+                                         ((old >> __tag_shift) + 1) << __tag_shift;
+                    if (head.compare_exchange_weak(old, next, std::memory_order_acquire, std::memory_order_acquire)) {
+                        return first;
+                    }
+                }
+                return nullptr;
+            }
+
+            static std::atomic<std::uint64_t> *__heads() noexcept {
+                static std::atomic<std::uint64_t> heads[size_classes];
+                return heads;
+            }
+
+            static __Cache &__cache() noexcept {
+                thread_local __Cache cache;
+                return cache;
+            }
+
+            static bool &__cache_alive() noexcept {
+                thread_local bool alive = true;
+                return alive;
+            }
+        };
+
+        // Wraps TraitUPtrDirect or TraitUPtrUPtr with the arena it was
+        // allocated from, so the shared deleter of TraitUPtr can return the
+        // memory to the right place
+        template<class Object, class Arena>
+        struct TraitUPtrArena final {
+            using Trait = typename Object::Trait;
+            Object object;
+            Arena *arena;
+            template<class ...Args>
+            TraitUPtrArena(Arena &arena_, Args&& ...args): object{std::forward<Args>(args)...}, arena(&arena_) {
+                object.header.ops = &ops;
+            }
+            TraitUPtrArena(TraitUPtrArena&) = delete;
+            TraitUPtrArena(TraitUPtrArena&&) = delete;
+            TraitUPtrArena& operator=(TraitUPtrArena&) = delete;
+            TraitUPtrArena& operator=(TraitUPtrArena&&) = delete;
+            template<class ...Args>
+            static Trait* make(Arena &arena, Args&& ...args) {
+                void *buffer = arena.allocate(sizeof(TraitUPtrArena), alignof(TraitUPtrArena));
+                try {
+                    return (new(buffer) TraitUPtrArena{arena, std::forward<Args>(args)...})->object.trait();
+                } catch (...) {
+                    // Rewinds a MonotonicArena, which left the buffer on top
+                    arena.deallocate(buffer, sizeof(TraitUPtrArena), alignof(TraitUPtrArena));
+                    throw;
+                }
+            }
+            static void drop(Trait *trait) {
+                TraitUPtrArena *ptr = reinterpret_cast<TraitUPtrArena*>(Object::of(trait));
+                Arena &arena = *ptr->arena;
+                ptr->~TraitUPtrArena();
+                arena.deallocate(ptr, sizeof(TraitUPtrArena), alignof(TraitUPtrArena));
+            }
+            static const __TraitUPtrOps<Trait> ops;
+        };
+
+        template<class Object, class Arena>
+        const __TraitUPtrOps<typename Object::Trait> TraitUPtrArena<Object, Arena>::ops{
+            drop, __clone_entry_of<Trait, typename Object::Base>(std::integral_constant<bool, Object::clonable>())
+        };
+
+        template<class Trait, class Arena, class Base>
+        TraitUPtr<Trait> own_in(Arena &arena, Base &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using UPtr=TraitUPtrArena<TraitUPtrDirect<Trait, Base>, Arena>;
+            return TraitUPtr<Trait>{UPtr::make(arena, std::forward<Base>(value)), __TraitUPtrHeader<Trait>::deleter};
+        }
+
+        template<class Trait, class Arena, class Base, class Deleter>
+        std::enable_if_t<(is_trait_h<Base, Trait>::value ||
+                          !is_trait_h<std::unique_ptr<Base, Deleter>, Trait>::value),
+                          TraitUPtr<Trait>> own_in(Arena &arena, std::unique_ptr<Base, Deleter> &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using UPtr=TraitUPtrArena<TraitUPtrUPtr<Trait, Base, Deleter>, Arena>;
+            return TraitUPtr<Trait>{UPtr::make(arena, std::move(value)), __TraitUPtrHeader<Trait>::deleter};
+        }
+
+        template<class Trait, class Base, class Arena, class ...Args>
+        TraitUPtr<Trait> make_in(Arena &arena, Args &&...args) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using UPtr=TraitUPtrArena<TraitUPtrDirect<Trait, Base>, Arena>;
+            return TraitUPtr<Trait>{UPtr::make(arena, std::forward<Args>(args)...), __TraitUPtrHeader<Trait>::deleter};
+        }
+
+        // Wraps TraitUPtrDirect or TraitUPtrUPtr allocated from SharedPool.
+        // The pool is global, so no arena pointer is stored
+        template<class Object>
+        struct TraitUPtrPooled final {
+            using Trait = typename Object::Trait;
+            Object object;
+            template<class ...Args>
+            TraitUPtrPooled(Args&& ...args): object{std::forward<Args>(args)...} {
+                object.header.ops = &ops;
+            }
+            TraitUPtrPooled(TraitUPtrPooled&) = delete;
+            TraitUPtrPooled(TraitUPtrPooled&&) = delete;
+            TraitUPtrPooled& operator=(TraitUPtrPooled&) = delete;
+            TraitUPtrPooled& operator=(TraitUPtrPooled&&) = delete;
+            template<class ...Args>
+            static Trait* make(Args&& ...args) {
+                void *buffer = SharedPool::allocate(sizeof(TraitUPtrPooled), alignof(TraitUPtrPooled));
+                try {
+                    return (new(buffer) TraitUPtrPooled{std::forward<Args>(args)...})->object.trait();
+                } catch (...) {
+                    SharedPool::deallocate(buffer, sizeof(TraitUPtrPooled), alignof(TraitUPtrPooled));
+                    throw;
+                }
+            }
+            static void drop(Trait *trait) {
+                TraitUPtrPooled *ptr = reinterpret_cast<TraitUPtrPooled*>(Object::of(trait));
+                ptr->~TraitUPtrPooled();
+                SharedPool::deallocate(ptr, sizeof(TraitUPtrPooled), alignof(TraitUPtrPooled));
+            }
+            static const __TraitUPtrOps<Trait> ops;
+        };
+
+        template<class Object>
+        const __TraitUPtrOps<typename Object::Trait> TraitUPtrPooled<Object>::ops{
+            drop, __clone_entry_of<Trait, typename Object::Base>(std::integral_constant<bool, Object::clonable>())
+        };
+
+        template<class Trait, class Base>
+        TraitUPtr<Trait> own_pooled(Base &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using UPtr=TraitUPtrPooled<TraitUPtrDirect<Trait, Base>>;
+            return TraitUPtr<Trait>{UPtr::make(std::forward<Base>(value)), __TraitUPtrHeader<Trait>::deleter};
+        }
+
+        template<class Trait, class Base, class Deleter>
+        std::enable_if_t<(is_trait_h<Base, Trait>::value ||
+                          !is_trait_h<std::unique_ptr<Base, Deleter>, Trait>::value),
+                          TraitUPtr<Trait>> own_pooled(std::unique_ptr<Base, Deleter> &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using UPtr=TraitUPtrPooled<TraitUPtrUPtr<Trait, Base, Deleter>>;
+            return TraitUPtr<Trait>{UPtr::make(std::move(value)), __TraitUPtrHeader<Trait>::deleter};
+        }
+
+        template<class Trait, class Base, class ...Args>
+        TraitUPtr<Trait> make_pooled(Args &&...args) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using UPtr=TraitUPtrPooled<TraitUPtrDirect<Trait, Base>>;
+            return TraitUPtr<Trait>{UPtr::make(std::forward<Args>(args)...), __TraitUPtrHeader<Trait>::deleter};
+        }
+
+        // Constructs a trait object whose destructor is never called, hence
+        // the trivially destructible Base: its memory is reclaimed together
+        // with everything else by MonotonicArena::reset(). If the
+        // constructor throws, the allocation is rewound
+        template<class Trait, class Base, class ...Args>
+        Trait &emplace_in(MonotonicArena &arena, Args &&...args) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            static_assert(std::is_trivially_destructible<typename is_trait_h<Base, Trait>::Base>::value,
+                          "emplace_in requires a trivially destructible type");
+            using Object=TraitUPtrDirect<Trait, Base>;
+            void *buffer = arena.allocate(sizeof(Object), alignof(Object));
+            try {
+                return *(new(buffer) Object{std::forward<Args>(args)...})->trait();
+            } catch (...) {
+                arena.deallocate(buffer, sizeof(Object), alignof(Object));
+                throw;
+            }
+        }
+
+        enum class __TraitValueOp {
+            move,
+            copy,
+            destroy
+        };
+
+        // Movable owning trait object with small-buffer storage: Base and its
+        // TraitImpl are placed inline when Base fits in InlineBytes and is
+        // nothrow movable, otherwise only Base is moved to the heap
+        template<class Trait, std::size_t InlineBytes = 4 * sizeof(void*)>
+        struct TraitValue final {
+            alignas(std::max_align_t) char storage[InlineBytes < sizeof(void*) ? sizeof(void*) : InlineBytes];
+            alignas(TraitRef<Trait>) char trait_buffer[sizeof(TraitRef<Trait>)];
+            void (*manager)(__TraitValueOp, TraitValue*, TraitValue*) = nullptr;
+
+            template<class Base>
+            constexpr static bool stores_inline = sizeof(Base) <= sizeof(storage) &&
+                                                  alignof(Base) <= alignof(std::max_align_t) &&
+                                                  std::is_nothrow_move_constructible<Base>::value;
+
+            TraitValue() = default;
+            TraitValue(TraitValue &&other) noexcept {
+                if (other.manager) {
+                    other.manager(__TraitValueOp::move, &other, this);
+                }
+            }
+            TraitValue &operator=(TraitValue &&other) noexcept {
+                if (this != &other) {
+                    reset();
+                    if (other.manager) {
+                        other.manager(__TraitValueOp::move, &other, this);
+                    }
+                }
+                return *this;
+            }
+            TraitValue(TraitValue&) = delete;
+            TraitValue& operator=(TraitValue&) = delete;
+            ~TraitValue() {
+                reset();
+            }
+
+            template<class Base_, class ...Args>
+            void emplace(Args&& ...args) {
+                using Base = typename is_trait_h<Base_, Trait>::Base;
+                using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+                static_assert(sizeof(TraitImpl) == sizeof(TraitRef<Trait>) && alignof(TraitImpl) == alignof(TraitRef<Trait>),
+                              "cannot accept a non-standard trait: size/alignment not match");
+                static_assert(std::is_trivially_destructible<TraitImpl>::value,
+                              "cannot accept a non-standard trait: not trivially destructible");
+                reset();
+                Base *base = __construct<Base>(std::integral_constant<bool, stores_inline<Base>>(),
+                                               std::forward<Args>(args)...);
+                new(trait_buffer) TraitImpl{*base};
+                manager = __manage<Base>;
+            }
+
+            void reset() noexcept {
+                if (manager) {
+                    manager(__TraitValueOp::destroy, this, nullptr);
+                    manager = nullptr;
+                }
+            }
+
+            explicit operator bool() const noexcept {
+                return manager != nullptr;
+            }
+            Trait* get() {
+                return manager ? reinterpret_cast<Trait*>(trait_buffer) : nullptr;
+            }
+            Trait& operator*() {
+                return *reinterpret_cast<Trait*>(trait_buffer);
+            }
+            Trait* operator->() {
+                return reinterpret_cast<Trait*>(trait_buffer);
+            }
+
+            template<class Base>
+            Base &cast() {
+                return trait::__impl::cast<Base>(**this);
+            }
+
+            template<class Base>
+            Base *try_cast() {
+                return manager ? trait::__impl::try_cast<Base>(**this) : nullptr;
+            }
+
+            TraitTypeId type_id() {
+                return manager ? trait::__impl::type_id(**this) : nullptr;
+            }
+
+            template<class Base, class ...Args>
+            Base *__construct(std::true_type, Args&& ...args) {
+                return new(storage) Base{std::forward<Args>(args)...};
+            }
+
+            template<class Base, class ...Args>
+            Base *__construct(std::false_type, Args&& ...args) {
+                Base *base = new Base{std::forward<Args>(args)...};
+                new(storage) Base*(base);
+                return base;
+            }
+
+            template<class Base>
+            static Base *__relocate(std::true_type, TraitValue *src, TraitValue *dst) noexcept {
+                Base *base = reinterpret_cast<Base*>(src->storage);
+                Base *moved = new(dst->storage) Base{std::move(*base)};
+                base->~Base();
+                return moved;
+            }
+
+            template<class Base>
+            static Base *__relocate(std::false_type, TraitValue *src, TraitValue *dst) noexcept {
+                Base *base = *reinterpret_cast<Base**>(src->storage);
+                new(dst->storage) Base*(base);
+                return base;
+            }
+
+            template<class Base>
+            static void __destroy(std::true_type, TraitValue *value) noexcept {
+                reinterpret_cast<Base*>(value->storage)->~Base();
+            }
+
+            template<class Base>
+            static void __destroy(std::false_type, TraitValue *value) noexcept {
+                delete *reinterpret_cast<Base**>(value->storage);
+            }
+
+            template<class Base>
+            static void __manage(__TraitValueOp op, TraitValue *src, TraitValue *dst) {
+                using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                using Inline = std::integral_constant<bool, stores_inline<Base>>;
+                switch (op) {
+                case __TraitValueOp::move:
+                    new(dst->trait_buffer) TraitImpl{*__relocate<Base>(Inline(), src, dst)};
+                    dst->manager = src->manager;
+                    src->manager = nullptr;
+                    break;
+                case __TraitValueOp::copy:
+                    __copy<Base>(TraitClone<Base>(), src, dst);
+                    break;
+                case __TraitValueOp::destroy:
+                    __destroy<Base>(Inline(), src);
+                    break;
+                }
+            }
+
+            template<class Base>
+            static void __copy(std::true_type, TraitValue *src, TraitValue *dst) {
+                using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                dst->template emplace<Base>(static_cast<Base&>(reinterpret_cast<TraitImpl*>(src->trait_buffer)->self));
+            }
+
+            template<class Base>
+            static void __copy(std::false_type, TraitValue *, TraitValue *) noexcept {}
+        };
+
+        template<class Trait_, std::size_t InlineBytes>
+        struct __TraitHandleTraits<TraitValue<Trait_, InlineBytes>> {
+            using Trait = Trait_;
+            static Trait &get(TraitValue<Trait, InlineBytes> &value) {
+                return *value;
+            }
+        };
+
+        template<class Trait, std::size_t InlineBytes = 4 * sizeof(void*), class Base>
+        TraitValue<Trait, InlineBytes> own_value(Base &&value) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            TraitValue<Trait, InlineBytes> result;
+            result.template emplace<Base>(std::forward<Base>(value));
+            return result;
+        }
+
+        template<class Trait, class Base, std::size_t InlineBytes = 4 * sizeof(void*), class ...Args>
+        TraitValue<Trait, InlineBytes> make_value(Args &&...args) {
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            TraitValue<Trait, InlineBytes> result;
+            result.template emplace<Base>(std::forward<Args>(args)...);
+            return result;
+        }
+
+        // Deep copy with the same storage policy. Empty when value is empty
+        // or TraitClone<Base> is false
+        template<class Trait, std::size_t InlineBytes>
+        TraitValue<Trait, InlineBytes> clone(const TraitValue<Trait, InlineBytes> &value) {
+            TraitValue<Trait, InlineBytes> result;
+            if (value.manager) {
+                value.manager(__TraitValueOp::copy, const_cast<TraitValue<Trait, InlineBytes>*>(&value), &result);
+            }
+            return result;
+        }
+
+        // Byte encoding of a Base for registry<Trait>. The default copies
+        // the object representation and only accepts trivially copyable
+        // types; specialize it for anything else
+        template<class Base>
+        struct TraitCodec {
+            static_assert(std::is_trivially_copyable<Base>::value,
+                          "specialize trait::TraitCodec for a type that is not trivially copyable");
+
+            static bool check(const char *, std::size_t size) noexcept {
+                return size == sizeof(Base);
+            }
+
+            static Base decode(const char *bytes, std::size_t) noexcept {
+                alignas(Base) char buffer[sizeof(Base)];
+                std::memcpy(buffer, bytes, sizeof(Base));
+                return *reinterpret_cast<Base*>(buffer);
+            }
+
+            static void encode(const Base &base, std::vector<char> &out) {
+                const char *bytes = reinterpret_cast<const char*>(&base);
+                out.insert(out.end(), bytes, bytes + sizeof(Base));
+            }
+        };
+
+        // Header of a record in an encoded stream, followed by size bytes of
+        // payload. Records are packed back to back without padding
+        struct TraitRecordHeader {
+            std::uint32_t tag;
+            std::uint32_t size;
+        };
+
+        template<class Trait>
+        struct __TraitRegistryEntry {
+            TraitTypeId id = nullptr;
+            std::size_t size = 0;
+            bool (*check)(const char *bytes, std::size_t size) = nullptr;
+            TraitUPtr<Trait> (*make)(const char *bytes, std::size_t size) = nullptr;
+            Trait *(*construct)(void *buffer, const char *bytes, std::size_t size) = nullptr;
+            void (*destroy)(Trait *trait) = nullptr;
+            void (*encode)(Trait &trait, std::vector<char> &out) = nullptr;
+            std::size_t base_size = 0;
+            std::size_t base_align = 1;
+            TraitRef<Trait> (*ref)(void *base) = nullptr;
+        };
+
+        // Specialized by TRAIT_REGISTER with the tag of a (Trait, Base)
+        template<class Trait, class Base>
+        struct __TraitRegistration;
+
+        template<class Trait, class Base>
+        struct __TraitRegistrar {
+            static const bool registered;
+        };
+
+        // Objects made by registry<Trait>::make_in: the arena and the entry
+        // are stored in front of the TraitUPtrDirect, so the plain function
+        // deleter can destroy and free any registered type
+        template<class Trait, class Arena>
+        struct __TraitRegistryBox {
+            Arena *arena;
+            const __TraitRegistryEntry<Trait> *entry;
+
+            constexpr static std::size_t offset = (2 * sizeof(void*) + alignof(std::max_align_t) - 1) /
+                                                  alignof(std::max_align_t) * alignof(std::max_align_t);
+
+            static void deleter(Trait *trait) {
+                char *object = reinterpret_cast<char*>(__TraitUPtrHeader<Trait>::of(trait));
+                __TraitRegistryBox *box = reinterpret_cast<__TraitRegistryBox*>(object - offset);
+                Arena &arena = *box->arena;
+                std::size_t size = offset + box->entry->size;
+                box->entry->destroy(trait);
+                arena.deallocate(box, size, alignof(std::max_align_t));
+            }
+        };
+
+        // Factory for trait objects of the types registered with
+        // TRAIT_REGISTER(Trait, Base, tag). Tags are chosen by the user so an
+        // encoded stream stays valid across builds, and may be any value but
+        // none; they are looked up in a hash table. Malformed input, unknown
+        // tags and payloads rejected by the codec give an empty TraitUPtr
+        template<class Trait>
+        struct registry final {
+            using Tag = std::uint32_t;
+            using Entry = __TraitRegistryEntry<Trait>;
+            constexpr static Tag none = ~Tag(0);
+
+            static bool contains(Tag tag) noexcept {
+                return __find(tag) != nullptr;
+            }
+
+            static TraitUPtr<Trait> make(Tag tag, const char *bytes, std::size_t size) {
+                const Entry *entry = __find(tag);
+                if (!entry || !entry->check(bytes, size)) {
+                    return TraitUPtr<Trait>{nullptr, nullptr};
+                }
+                return entry->make(bytes, size);
+            }
+
+            template<class Arena>
+            static TraitUPtr<Trait> make_in(Arena &arena, Tag tag, const char *bytes, std::size_t size) {
+                using Box = __TraitRegistryBox<Trait, Arena>;
+                const Entry *found = __find(tag);
+                if (!found || !found->check(bytes, size)) {
+                    return TraitUPtr<Trait>{nullptr, nullptr};
+                }
+                const Entry &entry = *found;
+                void *buffer = arena.allocate(Box::offset + entry.size, alignof(std::max_align_t));
+                new(buffer) Box{&arena, &entry};
+                try {
+                    return TraitUPtr<Trait>{entry.construct(static_cast<char*>(buffer) + Box::offset, bytes, size), Box::deleter};
+                } catch (...) {
+                    arena.deallocate(buffer, Box::offset + entry.size, alignof(std::max_align_t));
+                    throw;
+                }
+            }
+
+            // Tag of the registered type trait was made from, or none
+            static Tag tag_of(Trait &trait) noexcept {
+                auto &ids = __ids();
+                auto it = ids.find(type_id(trait));
+                return it != ids.end() ? it->second : none;
+            }
+
+            static Tag tag_of(TraitRef<Trait> ref) noexcept {
+                return tag_of(*ref);
+            }
+
+            template<class Base>
+            constexpr static Tag tag_of() noexcept {
+                return __TraitRegistration<Trait, Base>::tag;
+            }
+
+            // Appends one record; returns false when the type of trait is
+            // not registered
+            static bool encode(Trait &trait, std::vector<char> &out) {
+                Tag tag = tag_of(trait);
+                if (tag == none) {
+                    return false;
+                }
+                std::size_t start = out.size();
+                out.resize(start + sizeof(TraitRecordHeader));
+                __find(tag)->encode(trait, out);
+                TraitRecordHeader header{tag, static_cast<std::uint32_t>(out.size() - start - sizeof(TraitRecordHeader))};
+                std::memcpy(out.data() + start, &header, sizeof(header));
+                return true;
+            }
+
+            static bool encode(TraitRef<Trait> ref, std::vector<char> &out) {
+                return encode(*ref, out);
+            }
+
+            // Decodes records from a contiguous buffer into out until the
+            // end or the first record that cannot be decoded. Returns the
+            // number of bytes consumed
+            static std::size_t decode(const char *data, std::size_t size, std::vector<TraitUPtr<Trait>> &out) {
+                return __decode(data, size, out, [](Tag tag, const char *bytes, std::size_t length) {
+                    return __find(tag)->make(bytes, length);
+                });
+            }
+
+            template<class Arena>
+            static std::size_t decode_in(Arena &arena, const char *data, std::size_t size, std::vector<TraitUPtr<Trait>> &out) {
+                return __decode(data, size, out, [&arena](Tag tag, const char *bytes, std::size_t length) {
+                    return make_in(arena, tag, bytes, length);
+                });
+            }
+
+            template<class Make>
+            static std::size_t __decode(const char *data, std::size_t size, std::vector<TraitUPtr<Trait>> &out, Make &&make) {
+                std::size_t offset = 0;
+                while (size - offset >= sizeof(TraitRecordHeader)) {
+                    TraitRecordHeader header;
+                    std::memcpy(&header, data + offset, sizeof(header));
+                    const char *bytes = data + offset + sizeof(header);
+                    if (header.size > size - offset - sizeof(header)) {
+                        break;
+                    }
+                    const Entry *entry = __find(header.tag);
+                    if (!entry || !entry->check(bytes, header.size)) {
+                        break;
+                    }
+                    out.push_back(make(header.tag, bytes, std::size_t(header.size)));
+                    offset += sizeof(header) + header.size;
+                }
+                return offset;
+            }
+
+            // Entries are static per Base, the table only points to them, so
+            // references to an entry stay valid while more types register.
+            // A reserved or duplicate tag terminates during static
+            // initialization
+            template<class Base>
+            static bool __add(Tag tag) {
+                using Object = TraitUPtrDirect<Trait, Base>;
+                static_assert(alignof(Object) <= alignof(std::max_align_t), "over-aligned types cannot be registered");
+                static Entry entry;
+                if (tag == none || !__entries().emplace(tag, &entry).second) {
+                    std::terminate();
+                }
+                entry.id = type_id<Trait, Base>();
+                entry.size = sizeof(Object);
+                entry.check = TraitCodec<Base>::check;
+                entry.make = [](const char *bytes, std::size_t size) {
+                    return TraitUPtr<Trait>{Object::make(TraitCodec<Base>::decode(bytes, size)), __TraitUPtrHeader<Trait>::deleter};
+                };
+                entry.construct = [](void *buffer, const char *bytes, std::size_t size) {
+                    return (new(buffer) Object{TraitCodec<Base>::decode(bytes, size)})->trait();
+                };
+                entry.destroy = [](Trait *trait) {
+                    Object::of(trait)->~Object();
+                };
+                entry.encode = [](Trait &trait, std::vector<char> &out) {
+                    TraitCodec<Base>::encode(trait::__impl::cast<Base>(trait), out);
+                };
+                entry.base_size = sizeof(Base);
+                entry.base_align = alignof(Base);
+                entry.ref = [](void *base) {
+                    return TraitRef<Trait>(*static_cast<Base*>(base));
+                };
+                __ids().emplace(entry.id, tag);
+                return true;
+            }
+
+            static const Entry *__find(Tag tag) noexcept {
+                auto &entries = __entries();
+                auto it = entries.find(tag);
+                return it != entries.end() ? it->second : nullptr;
+            }
+
+            static std::unordered_map<Tag, const Entry*> &__entries() {
+                static std::unordered_map<Tag, const Entry*> entries;
+                return entries;
+            }
+
+            static std::unordered_map<TraitTypeId, Tag> &__ids() {
+                static std::unordered_map<TraitTypeId, Tag> ids;
+                return ids;
+            }
+        };
+
+        template<class Trait, class Base>
+        const bool __TraitRegistrar<Trait, Base>::registered =
+            registry<Trait>::template __add<Base>(__TraitRegistration<Trait, Base>::tag);
+
+        // Position-independent trait object for memory shared between
+        // processes or mapped from a file. Instead of a virtual table
+        // pointer and a self pointer it stores the registry tag of the impl
+        // and the distance from this header to Base, which mean the same in
+        // every process registering the type with the same tag. get()
+        // resolves the tag in the local registry and refers to Base where it
+        // lies, without copying or decoding. Base must be trivially copyable
+        // and must not hold pointers
+        template<class Trait>
+        struct TraitMapped final {
+            std::uint32_t tag;
+            // Bytes from this header to the next record
+            std::uint32_t size;
+            // Bytes from this header to Base
+            std::int32_t offset;
+
+            // Whether the tag is registered in this process and the record
+            // is large enough and aligned for its type
+            bool valid() const noexcept {
+                if (!__steppable() || offset < std::int32_t(sizeof(TraitMapped))) {
+                    return false;
+                }
+                const auto *entry = registry<Trait>::__find(tag);
+                return entry && std::uint64_t(offset) + entry->base_size <= size &&
+                       (reinterpret_cast<std::uintptr_t>(this) + std::uint32_t(offset)) % entry->base_align == 0;
+            }
+
+            void *base() noexcept {
+                return reinterpret_cast<char*>(this) + offset;
+            }
+
+            TraitRef<Trait> get() {
+                if (!valid()) {
+                    std::terminate();
+                }
+                return registry<Trait>::__find(tag)->ref(base());
+            }
+
+            template<class Base>
+            Base *try_cast() noexcept {
+                return tag == registry<Trait>::template tag_of<Base>() ? static_cast<Base*>(base()) : nullptr;
+            }
+
+            // Null after a record whose size cannot lead to another record,
+            // so a walk over garbage ends. Records with unknown tags are
+            // stepped over
+            TraitMapped *next() noexcept {
+                return __steppable() ? reinterpret_cast<TraitMapped*>(reinterpret_cast<char*>(this) + size) : nullptr;
+            }
+
+            bool __steppable() const noexcept {
+                return reinterpret_cast<std::uintptr_t>(this) % alignof(TraitMapped) == 0 &&
+                       size >= sizeof(TraitMapped) && size % alignof(TraitMapped) == 0;
+            }
+        };
+
+        // Bytes taken by one record written by emplace_mapped. Records
+        // placed back to back from an address aligned to max_align_t stay
+        // aligned, as does a region mapped at any page
+        template<class Trait, class Base>
+        constexpr std::size_t mapped_size() noexcept {
+            return ((sizeof(TraitMapped<Trait>) + alignof(Base) - 1) / alignof(Base) * alignof(Base) + sizeof(Base) +
+                    alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+        }
+
+        // Writes a TraitMapped record with a Base made from args at memory,
+        // which must be aligned to max_align_t and hold mapped_size bytes.
+        // Base must be registered for Trait with TRAIT_REGISTER
+        template<class Trait, class Base, class ...Args>
+        TraitMapped<Trait> &emplace_mapped(void *memory, Args &&...args) {
+            static_assert(std::is_trivially_copyable<Base>::value, "mapped trait objects must be trivially copyable");
+            static_assert(alignof(Base) <= alignof(std::max_align_t), "over-aligned types cannot be mapped");
+            constexpr std::size_t offset = (sizeof(TraitMapped<Trait>) + alignof(Base) - 1) / alignof(Base) * alignof(Base);
+            new(static_cast<char*>(memory) + offset) Base{std::forward<Args>(args)...};
+            return *new(memory) TraitMapped<Trait>{registry<Trait>::template tag_of<Base>(),
+                                                   std::uint32_t(mapped_size<Trait, Base>()), std::int32_t(offset)};
+        }
+
+        // Identity of a type without RTTI: one address per type
+        template<class T>
+        struct __TypeTag {
+            static const char id;
+        };
+
+        template<class T>
+        const char __TypeTag<T>::id = 0;
+
+        // Heterogeneous collection that stores each concrete type in its own
+        // contiguous bucket. for_each resolves the TraitImpl once per bucket
+        // and passes the final TraitImpl to fn, so calls bind statically.
+        // Elements are indexed bucket by bucket in the order of Types
+        template<class Trait, class ...Types>
+        struct TraitVec final {
+            static_assert(__is_trait_h_conj<is_trait_h<Types, Trait>...>::value, "trait not implemented for this type");
+            std::tuple<std::vector<Types>...> buckets;
+
+            template<class Base>
+            std::vector<Base> &bucket() {
+                return std::get<std::vector<Base>>(buckets);
+            }
+
+            template<class Base>
+            void push_back(Base &&value) {
+                bucket<std::decay_t<Base>>().push_back(std::forward<Base>(value));
+            }
+
+            template<class Base, class ...Args>
+            Base &emplace(Args&& ...args) {
+                std::vector<Base> &items = bucket<Base>();
+                items.push_back(Base{std::forward<Args>(args)...});
+                return items.back();
+            }
+
+            std::size_t size() const {
+                std::size_t result = 0;
+                using __expand = int[];
+                (void)__expand{0, (result += std::get<std::vector<Types>>(buckets).size(), 0)...};
+                return result;
+            }
+
+            void clear() {
+                using __expand = int[];
+                (void)__expand{0, (std::get<std::vector<Types>>(buckets).clear(), 0)...};
+            }
+
+            template<class Fn>
+            void for_each(Fn &&fn) {
+                using __expand = int[];
+                (void)__expand{0, (__for_each_bucket(std::get<std::vector<Types>>(buckets), fn), 0)...};
+            }
+
+            TraitRef<Trait> operator[](std::size_t index) {
+                return __at(index, std::integral_constant<std::size_t, 0>());
+            }
+
+            template<class Base, class Fn>
+            static void __for_each_bucket(std::vector<Base> &items, Fn &fn) {
+                using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                for (Base &item : items) {
+                    TraitImpl impl{item};
+                    fn(impl);
+                }
+            }
+
+            template<std::size_t I>
+            TraitRef<Trait> __at(std::size_t index, std::integral_constant<std::size_t, I>) {
+                auto &items = std::get<I>(buckets);
+                if (index < items.size()) {
+                    return TraitRef<Trait>(items[index]);
+                }
+                return __at(index - items.size(), std::integral_constant<std::size_t, I + 1>());
+            }
+
+            TraitRef<Trait> __at(std::size_t index, std::integral_constant<std::size_t, sizeof...(Types) - 1>) {
+                auto &items = std::get<sizeof...(Types) - 1>(buckets);
+                if (index >= items.size()) {
+                    // Out of range, as in the open TraitVec
+                    std::terminate();
+                }
+                return TraitRef<Trait>(items[index]);
+            }
+        };
+
+        // Open-ended TraitVec: buckets are created on first insertion of a
+        // type. for_each still walks one bucket at a time, so the dynamic
+        // calls within a bucket all go to the same TraitImpl
+        template<class Trait>
+        struct TraitVec<Trait> final {
+            struct __Bucket {
+                const void *type;
+                explicit __Bucket(const void *type_) noexcept : type(type_) {}
+                virtual ~__Bucket() = default;
+                virtual std::size_t size() const = 0;
+                virtual void clear() = 0;
+                virtual TraitRef<Trait> at(std::size_t index) = 0;
+                virtual void visit(void *fn, void (*call)(void*, Trait&)) = 0;
+            };
+
+            template<class Base>
+            struct __TypedBucket final : public __Bucket {
+                using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                std::vector<Base> items;
+                __TypedBucket() noexcept : __Bucket(&__TypeTag<Base>::id) {}
+                std::size_t size() const override {
+                    return items.size();
+                }
+                void clear() override {
+                    items.clear();
+                }
+                TraitRef<Trait> at(std::size_t index) override {
+                    return TraitRef<Trait>(items[index]);
+                }
+                void visit(void *fn, void (*call)(void*, Trait&)) override {
+                    for (Base &item : items) {
+                        TraitImpl impl{item};
+                        call(fn, impl);
+                    }
+                }
+            };
+
+            std::vector<std::unique_ptr<__Bucket>> buckets;
+
+            template<class Base>
+            std::vector<Base> &bucket() {
+                static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+                for (auto &b : buckets) {
+                    if (b->type == &__TypeTag<Base>::id) {
+                        return static_cast<__TypedBucket<Base>&>(*b).items;
+                    }
+                }
+                buckets.emplace_back(new __TypedBucket<Base>());
+                return static_cast<__TypedBucket<Base>&>(*buckets.back()).items;
+            }
+
+            template<class Base>
+            void push_back(Base &&value) {
+                bucket<std::decay_t<Base>>().push_back(std::forward<Base>(value));
+            }
+
+            template<class Base, class ...Args>
+            Base &emplace(Args&& ...args) {
+                std::vector<Base> &items = bucket<Base>();
+                items.push_back(Base{std::forward<Args>(args)...});
+                return items.back();
+            }
+
+            std::size_t size() const {
+                std::size_t result = 0;
+                for (auto &b : buckets) {
+                    result += b->size();
+                }
+                return result;
+            }
+
+            void clear() {
+                for (auto &b : buckets) {
+                    b->clear();
+                }
+            }
+
+            template<class Fn>
+            void for_each(Fn &&fn) {
+                for (auto &b : buckets) {
+                    b->visit(&fn, __call<std::remove_reference_t<Fn>>);
+                }
+            }
+
+            TraitRef<Trait> operator[](std::size_t index) {
+                for (auto &b : buckets) {
+                    if (index < b->size()) {
+                        return b->at(index);
+                    }
+                    index -= b->size();
+                }
+                // Out of range, possibly with no bucket at all
+                std::terminate();
+            }
+
+            template<class Fn>
+            static void __call(void *fn, Trait &trait) {
+                (*static_cast<Fn*>(fn))(trait);
+            }
+        };
+
+        // Position of T in Types, compared by exact type
+        template<class T, class ...Types>
+        struct __TypeIndex {
+            constexpr static bool found = false;
+            constexpr static std::size_t value = 0;
+        };
+
+        template<class T, class First, class ...Rest>
+        struct __TypeIndex<T, First, Rest...> {
+            constexpr static bool found = std::is_same<T, First>::value || __TypeIndex<T, Rest...>::found;
+            constexpr static std::size_t value = std::is_same<T, First>::value ? 0 : __TypeIndex<T, Rest...>::value + 1;
+        };
+
+        constexpr std::size_t __max_size(std::initializer_list<std::size_t> sizes) {
+            std::size_t result = 0;
+            for (std::size_t size : sizes) {
+                result = size > result ? size : result;
+            }
+            return result;
+        }
+
+        // Closed set of types implementing Trait, stored inline with a tag.
+        // visit and ->* branch on the tag and call the final TraitImpl of the
+        // active type, so there is no allocation and no indirect call.
+        // Converts to TraitRef<Trait> where open dynamic dispatch is needed
+        template<class Trait, class ...Types>
+        struct TraitEnum final {
+            static_assert(sizeof...(Types) > 0 && sizeof...(Types) <= 256, "TraitEnum supports 1 to 256 types");
+            static_assert(__is_trait_h_conj<is_trait_h<Types, Trait>...>::value, "trait not implemented for this type");
+            using __Types = std::tuple<Types...>;
+            alignas(Types...) char storage[__max_size({sizeof(Types)...})];
+            std::uint8_t tag;
+
+            template<class Base_, class Base=std::decay_t<Base_>,
+                     class __assert=std::enable_if_t<__TypeIndex<Base, Types...>::found>>
+            TraitEnum(Base_ &&value) : tag(__TypeIndex<Base, Types...>::value) {
+                new(storage) Base(std::forward<Base_>(value));
+            }
+            TraitEnum(const TraitEnum &other) : tag(other.tag) {
+                other.__dispatch([this, &other](auto index) {
+                    using Base = std::tuple_element_t<decltype(index)::value, __Types>;
+                    new(storage) Base(*reinterpret_cast<const Base*>(other.storage));
+                });
+            }
+            TraitEnum(TraitEnum &&other) noexcept(__is_trait_h_conj<std::is_nothrow_move_constructible<Types>...>::value) :
+                tag(other.tag) {
+                other.__dispatch([this, &other](auto index) {
+                    using Base = std::tuple_element_t<decltype(index)::value, __Types>;
+                    new(storage) Base(std::move(*reinterpret_cast<Base*>(other.storage)));
+                });
+            }
+            // There is no valueless state: the old value is only destroyed
+            // once the new one cannot throw, so a throwing copy constructor
+            // leaves the old value in place
+            TraitEnum &operator=(const TraitEnum &other) {
+                if (this != &other) {
+                    __assign(other, __is_trait_h_conj<std::is_nothrow_copy_constructible<Types>...>());
+                }
+                return *this;
+            }
+            TraitEnum &operator=(TraitEnum &&other) noexcept {
+                static_assert(__is_trait_h_conj<std::is_nothrow_move_constructible<Types>...>::value,
+                              "TraitEnum assignment needs nothrow move constructible types");
+                if (this != &other) {
+                    __destroy();
+                    new(this) TraitEnum(std::move(other));
+                }
+                return *this;
+            }
+            ~TraitEnum() {
+                __destroy();
+            }
+
+            template<class Base, class ...Args>
+            Base &emplace(Args&& ...args) {
+                static_assert(__TypeIndex<Base, Types...>::found, "type not in this TraitEnum");
+                return __emplace<Base>(std::is_nothrow_constructible<Base, Args&&...>(), std::forward<Args>(args)...);
+            }
+
+            std::size_t index() const noexcept {
+                return tag;
+            }
+
+            template<class Base>
+            bool is() const noexcept {
+                return tag == __TypeIndex<Base, Types...>::value;
+            }
+
+            template<class Base>
+            Base *get_if() noexcept {
+                static_assert(__TypeIndex<Base, Types...>::found, "type not in this TraitEnum");
+                return is<Base>() ? reinterpret_cast<Base*>(storage) : nullptr;
+            }
+
+            // fn receives the final TraitImpl of the active type
+            template<class Fn>
+            decltype(auto) visit(Fn &&fn) {
+                return __dispatch([this, &fn](auto index)->decltype(auto) {
+                    using Base = std::tuple_element_t<decltype(index)::value, __Types>;
+                    using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                    TraitImpl impl{*reinterpret_cast<Base*>(storage)};
+                    return fn(impl);
+                });
+            }
+
+            template<class C, class R, class ...Args,
+                     class __assert=std::enable_if_t<std::is_base_of<C, Trait>::value>>
+            auto operator->*(R (C::*method)(Args...)) {
+                return [this, method](Args ...args)->R {
+                    return visit([&](auto &impl)->R {
+                        return (impl.*method)(std::forward<Args>(args)...);
+                    });
+                };
+            }
+
+            TraitRef<Trait> ref() {
+                return __dispatch([this](auto index) {
+                    using Base = std::tuple_element_t<decltype(index)::value, __Types>;
+                    return TraitRef<Trait>(*reinterpret_cast<Base*>(storage));
+                });
+            }
+
+            operator TraitRef<Trait>() {
+                return ref();
+            }
+
+            void __destroy() noexcept {
+                __dispatch([this](auto index) {
+                    using Base = std::tuple_element_t<decltype(index)::value, __Types>;
+                    reinterpret_cast<Base*>(storage)->~Base();
+                });
+            }
+
+            void __assign(const TraitEnum &other, std::true_type) noexcept {
+                __destroy();
+                new(this) TraitEnum(other);
+            }
+
+            void __assign(const TraitEnum &other, std::false_type) {
+                TraitEnum copy(other);
+                *this = std::move(copy);
+            }
+
+            template<class Base, class ...Args>
+            Base &__emplace(std::true_type, Args&& ...args) noexcept {
+                __destroy();
+                Base *base = new(storage) Base{std::forward<Args>(args)...};
+                tag = __TypeIndex<Base, Types...>::value;
+                return *base;
+            }
+
+            // Constructed aside, then moved in
+            template<class Base, class ...Args>
+            Base &__emplace(std::false_type, Args&& ...args) {
+                static_assert(std::is_nothrow_move_constructible<Base>::value,
+                              "TraitEnum::emplace needs a nothrow constructor or a nothrow move constructor");
+                Base value{std::forward<Args>(args)...};
+                return __emplace<Base>(std::true_type(), std::move(value));
+            }
+
+            // Calls fn with the index of the active type as an integral_constant;
+            // the comparison chain is compiled into a switch over tag
+            template<class Fn>
+            decltype(auto) __dispatch(Fn &&fn) const {
+                return __dispatch(std::integral_constant<std::size_t, 0>(), fn);
+            }
+
+            template<std::size_t I, class Fn>
+            decltype(auto) __dispatch(std::integral_constant<std::size_t, I> index, Fn &fn) const {
+                if (tag == I) {
+                    return fn(index);
+                }
+                return __dispatch(std::integral_constant<std::size_t, I + 1>(), fn);
+            }
+
+            template<class Fn>
+            decltype(auto) __dispatch(std::integral_constant<std::size_t, sizeof...(Types) - 1> index, Fn &fn) const {
+                return fn(index);
+            }
+        };
+
+        template<class Method, Method Pointer>
+        struct __DynMethod;
+
+        // One entry of a Dyn table: thunk<Trait, Base> calls the method on
+        // the final TraitImpl of Base, so the call binds statically and the
+        // temporary TraitImpl is optimized away. The table of Dyn<const
+        // Trait> leaves the entry null, it cannot call the method
+        template<class C, class R, class ...Args, R (C::*Pointer)(Args...)>
+        struct __DynMethod<R (C::*)(Args...), Pointer> {
+            using Thunk = R (*)(void*, Args...);
+            template<class Trait, class Base>
+            static R thunk(void *data, Args ...args) {
+                using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                TraitImpl impl{*static_cast<Base*>(data)};
+                return (impl.*Pointer)(std::forward<Args>(args)...);
+            }
+            template<class Trait, class Base>
+            constexpr static Thunk entry() {
+                return std::is_const<Trait>::value ? nullptr : &thunk<std::remove_const_t<Trait>, Base>;
+            }
+        };
+
+        // A const method through a const TraitImpl. The TraitImpl refers to
+        // Base without const, the method is trusted to only read it
+        template<class C, class R, class ...Args, R (C::*Pointer)(Args...) const>
+        struct __DynMethod<R (C::*)(Args...) const, Pointer> {
+            using Thunk = R (*)(const void*, Args...);
+            template<class Trait, class Base>
+            static R thunk(const void *data, Args ...args) {
+                using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+                const TraitImpl impl{const_cast<Base&>(*static_cast<const Base*>(data))};
+                return (impl.*Pointer)(std::forward<Args>(args)...);
+            }
+            template<class Trait, class Base>
+            constexpr static Thunk entry() {
+                return &thunk<std::remove_const_t<Trait>, Base>;
+            }
+        };
+
+        template<class ...Methods>
+        struct __DynMethods {};
+
+        // Specialized by TRAIT_DYN with the methods callable through Dyn<Trait>
+        template<class Trait>
+        struct __TraitDynMethods;
+
+        // Dyn<const Trait> has a table of its own over the same methods
+        template<class Trait>
+        struct __TraitDynMethods<const Trait> : public __TraitDynMethods<Trait> {};
+
+        template<class Trait, class Methods=typename __TraitDynMethods<Trait>::type>
+        struct __DynTable;
+
+        template<class Trait, class ...Methods>
+        struct __DynTable<Trait, __DynMethods<Methods...>> {
+            std::tuple<typename Methods::Thunk...> thunks;
+
+            template<class Base>
+            constexpr static __DynTable make() {
+                return __DynTable{std::tuple<typename Methods::Thunk...>(Methods::template entry<Trait, Base>()...)};
+            }
+
+            // The entry of a method is found by its type, so calling a
+            // method that TRAIT_DYN does not list fails to compile
+            template<class R, class Method, class Data, class ...Args>
+            R invoke(Data *data, Method, Args&& ...args) const {
+                static_assert(__TypeIndex<Method, Methods...>::found, "method is not declared with TRAIT_DYN");
+                return std::get<__TypeIndex<Method, Methods...>::value>(thunks)(data, std::forward<Args>(args)...);
+            }
+        };
+
+        template<class Trait, class Base>
+        struct __DynTableFor {
+            static const __DynTable<Trait> table;
+        };
+
+        template<class Trait, class Base>
+        const __DynTable<Trait> __DynTableFor<Trait, Base>::table = __DynTable<Trait>::template make<Base>();
+
+        // Fat pointer made of the object address and a static per (Trait, Base)
+        // table of the methods listed by TRAIT_DYN. Unlike TraitRef it does not
+        // hold a TraitImpl and is trivially copyable. Methods are named by
+        // TRAIT_DYN_FN, which selects the table entry at compile time.
+        // Dyn<const Trait> also points to const objects and only calls the
+        // const methods of the list
+        template<class Trait>
+        struct Dyn final {
+            template<class T>
+            using __Const = std::conditional_t<std::is_const<Trait>::value, const T, T>;
+            // The type checked for the impl, a const Base only for Dyn<Trait>
+            template<class Base>
+            using __Object = std::conditional_t<std::is_const<Trait>::value, std::remove_const_t<Base>, Base>;
+
+            __Const<void> *data;
+            const __DynTable<Trait> *table;
+
+            template<class Base, class __assert=trait_assert<__Object<Base>, std::remove_const_t<Trait>>>
+            Dyn(Base &base) noexcept : data(&base), table(&__DynTableFor<Trait, __Object<Base>>::table) {}
+
+            template<class C, class R, class ...Args, R (C::*Pointer)(Args...),
+                     class __assert=std::enable_if_t<std::is_base_of<C, Trait>::value>>
+            auto operator->*(__DynMethod<R (C::*)(Args...), Pointer> method) const {
+                static_assert(!std::is_const<Trait>::value, "Dyn<const Trait> can only call const methods");
+                return __call<R, Args...>(method);
+            }
+
+            template<class C, class R, class ...Args, R (C::*Pointer)(Args...) const,
+                     class __assert=std::enable_if_t<std::is_base_of<C, Trait>::value>>
+            auto operator->*(__DynMethod<R (C::*)(Args...) const, Pointer> method) const {
+                return __call<R, Args...>(method);
+            }
+
+            template<class Base>
+            __Const<Base> &cast() const {
+                return *static_cast<__Const<Base>*>(data);
+            }
+
+            template<class R, class ...Args, class Method>
+            auto __call(Method method) const {
+                const __DynTable<Trait> *table_ = table;
+                __Const<void> *data_ = data;
+                return [table_, data_, method](Args ...args)->R {
+                    return table_->template invoke<R>(data_, method, std::forward<Args>(args)...);
+                };
+            }
+        };
+
+        // Small work-stealing pool for parallel_for_each. A loop starts as
+        // one index range; the thread running a range splits off its upper
+        // half into its own queue until the range is at most the grain, and
+        // idle threads steal the oldest, largest ranges from the other
+        // queues. Threads outside the pool, including the caller, queue
+        // their ranges in a shared queue and help until the loop is done
+        struct ThreadPool final {
+            struct __Loop {
+                void *body;
+                void (*run)(void *body, std::size_t begin, std::size_t end);
+                std::size_t (*split)(void *body, std::size_t begin, std::size_t end);
+                std::size_t grain;
+                std::atomic<std::size_t> remaining;
+                std::exception_ptr error;
+                std::atomic<bool> failed{false};
+            };
+
+            struct __Range {
+                __Loop *loop;
+                std::size_t begin;
+                std::size_t end;
+            };
+
+            struct __Queue {
+                std::mutex mutex;
+                std::deque<__Range> ranges;
+            };
+
+            // The last queue is shared by threads outside the pool
+            std::vector<std::unique_ptr<__Queue>> queues;
+            std::vector<std::thread> threads;
+            std::mutex sleep_mutex;
+            std::condition_variable wake;
+            std::atomic<std::size_t> queued{0};
+            std::atomic<std::size_t> sleeping{0};
+            std::atomic<bool> stop{false};
+
+            explicit ThreadPool(std::size_t workers) {
+                for (std::size_t i = 0; i <= workers; i++) {
+                    queues.emplace_back(new __Queue);
+                }
+                for (std::size_t i = 0; i < workers; i++) {
+                    threads.emplace_back([this, i]() {
+                        __worker(i);
+                    });
+                }
+            }
+            ThreadPool(ThreadPool&) = delete;
+            ThreadPool& operator=(ThreadPool&) = delete;
+            ~ThreadPool() {
+                {
+                    std::lock_guard<std::mutex> lock(sleep_mutex);
+                    stop.store(true);
+                }
+                wake.notify_all();
+                for (std::thread &thread : threads) {
+                    thread.join();
+                }
+            }
+
+            std::size_t size() const noexcept {
+                return threads.size();
+            }
+
+            // Shared by parallel_for_each without a pool argument; one worker
+            // less than the hardware threads, as the caller works too
+            static ThreadPool &global() {
+                static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+                return pool;
+            }
+
+            // Calls body(begin, end) on disjoint ranges covering [0, count)
+            // and returns when all have finished, rethrowing the first
+            // exception. split(begin, end) picks where a range is divided
+            template<class Body, class Split>
+            void run(std::size_t count, Body &&body, Split &&split, std::size_t grain = 0) {
+                if (!count) {
+                    return;
+                }
+                if (!grain) {
+                    grain = std::max<std::size_t>(1, count / (8 * (size() + 1)));
+                }
+                if (count <= grain || threads.empty()) {
+                    body(std::size_t(0), count);
+                    return;
+                }
+                using BodyFn = std::remove_reference_t<Body>;
+                using SplitFn = std::remove_reference_t<Split>;
+                struct Context {
+                    BodyFn &body;
+                    SplitFn &split;
+                };
+                Context context{body, split};
+                __Loop loop;
+                loop.body = &context;
+                loop.run = [](void *c, std::size_t begin, std::size_t end) {
+                    static_cast<Context*>(c)->body(begin, end);
+                };
+                loop.split = [](void *c, std::size_t begin, std::size_t end) {
+                    return static_cast<Context*>(c)->split(begin, end);
+                };
+                loop.grain = grain;
+                loop.remaining.store(count);
+                __execute(__Range{&loop, 0, count}, __index());
+                while (loop.remaining.load(std::memory_order_acquire)) {
+                    if (!__help(__index())) {
+                        std::this_thread::yield();
+                    }
+                }
+                if (loop.failed.load()) {
+                    std::rethrow_exception(loop.error);
+                }
+            }
+
+            // Queue of the calling thread: its own for a worker of this pool,
+            // the shared one otherwise
+            std::size_t __index() const noexcept {
+                const std::pair<const ThreadPool*, std::size_t> &current = __current();
+                return current.first == this ? current.second : threads.size();
+            }
+
+            static std::pair<const ThreadPool*, std::size_t> &__current() noexcept {
+                thread_local std::pair<const ThreadPool*, std::size_t> current{nullptr, 0};
+                return current;
+            }
+
+            void __execute(__Range range, std::size_t index) {
+                __Loop &loop = *range.loop;
+                while (range.end - range.begin > loop.grain) {
+                    std::size_t middle = loop.split(loop.body, range.begin, range.end);
+                    if (middle <= range.begin || middle >= range.end) {
+                        break;
+                    }
+                    __push(index, __Range{&loop, middle, range.end});
+                    range.end = middle;
+                }
+                if (!loop.failed.load(std::memory_order_relaxed)) {
+                    try {
+                        loop.run(loop.body, range.begin, range.end);
+                    } catch (...) {
+                        if (!loop.failed.exchange(true)) {
+                            loop.error = std::current_exception();
+                        }
+                    }
+                }
+                loop.remaining.fetch_sub(range.end - range.begin, std::memory_order_acq_rel);
+            }
+
+            void __push(std::size_t index, __Range range) {
+                {
+                    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+                    queues[index]->ranges.push_back(range);
+                }
+                queued.fetch_add(1);
+                if (sleeping.load()) {
+                    std::lock_guard<std::mutex> lock(sleep_mutex);
+                    wake.notify_one();
+                }
+            }
+
+            // Runs one range from the own queue, newest first, or stolen from
+            // another queue, oldest first. Returns false when all are empty
+            bool __help(std::size_t index) {
+                __Range range;
+                bool found = __pop_back(index, range);
+                for (std::size_t i = 1; !found && i < queues.size(); i++) {
+                    found = __pop_front((index + i) % queues.size(), range);
+                }
+                if (found) {
+                    __execute(range, index);
+                }
+                return found;
+            }
+
+            bool __pop_back(std::size_t index, __Range &range) {
+                std::lock_guard<std::mutex> lock(queues[index]->mutex);
+                if (queues[index]->ranges.empty()) {
+                    return false;
+                }
+                range = queues[index]->ranges.back();
+                queues[index]->ranges.pop_back();
+                queued.fetch_sub(1);
+                return true;
+            }
+
+            bool __pop_front(std::size_t index, __Range &range) {
+                std::lock_guard<std::mutex> lock(queues[index]->mutex);
+                if (queues[index]->ranges.empty()) {
+                    return false;
+                }
+                range = queues[index]->ranges.front();
+                queues[index]->ranges.pop_front();
+                queued.fetch_sub(1);
+                return true;
+            }
+
+            void __worker(std::size_t index) {
+                __current() = std::make_pair(this, index);
+                while (true) {
+                    if (__help(index)) {
+                        continue;
+                    }
+                    std::unique_lock<std::mutex> lock(sleep_mutex);
+                    sleeping.fetch_add(1);
+                    while (!queued.load() && !stop.load()) {
+                        wake.wait(lock);
+                    }
+                    sleeping.fetch_sub(1);
+                    if (stop.load()) {
+                        return;
+                    }
+                }
+            }
+        };
+
+        // Splits near the middle of [begin, end), moved to the closest
+        // position within a quarter of the range where same(i) is false, so
+        // a run of elements of one impl is not divided between two threads
+        template<class Same>
+        std::size_t __split_at_run(std::size_t begin, std::size_t end, Same &same) {
+            std::size_t middle = begin + (end - begin) / 2;
+            std::size_t window = (end - begin) / 4;
+            for (std::size_t distance = 0; distance <= window; distance++) {
+                if (middle + distance < end && !same(middle + distance)) {
+                    return middle + distance;
+                }
+                if (middle - distance > begin && !same(middle - distance)) {
+                    return middle - distance;
+                }
+            }
+            return middle;
+        }
+
+        template<class Trait>
+        Trait &__element_trait(TraitRef<Trait> &ref) {
+            return *ref;
+        }
+
+        template<class Trait>
+        Trait &__element_trait(TraitUPtr<Trait> &ptr) {
+            return *ptr;
+        }
+
+        template<class Handle, class HandleTrait=typename __TraitHandleTraits<Handle>::Trait>
+        HandleTrait &__element_trait(Handle &handle) {
+            return __TraitHandleTraits<Handle>::get(handle);
+        }
+
+        // Calls fn(trait) for every element of a random access range of
+        // TraitRef, TraitUPtr or other owning trait objects, none empty, in
+        // parallel. Each thread walks a contiguous part of the range, and
+        // parts are split between runs of the same impl, so sorting or
+        // grouping the range by type keeps every run on one thread
+        template<class Range, class Fn>
+        void parallel_for_each(ThreadPool &pool, Range &range, Fn &&fn) {
+            auto first = std::begin(range);
+            std::size_t count = static_cast<std::size_t>(std::end(range) - first);
+            auto same = [&first](std::size_t i) {
+                return type_id(__element_trait(first[i])) == type_id(__element_trait(first[i - 1]));
+            };
+            pool.run(count, [&first, &fn](std::size_t begin, std::size_t end) {
+                for (std::size_t i = begin; i < end; i++) {
+                    fn(__element_trait(first[i]));
+                }
+            }, [&same](std::size_t begin, std::size_t end) {
+                return __split_at_run(begin, end, same);
+            });
+        }
+
+        // Static dispatch over a range of one concrete type: fn gets the
+        // final TraitImpl of every element, so its calls bind statically
+        template<class Trait, class Range, class Fn>
+        void parallel_for_each(ThreadPool &pool, Range &range, Fn &&fn) {
+            using Base = std::remove_reference_t<decltype(*std::begin(range))>;
+            static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+            using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+            auto first = std::begin(range);
+            std::size_t count = static_cast<std::size_t>(std::end(range) - first);
+            pool.run(count, [&first, &fn](std::size_t begin, std::size_t end) {
+                for (std::size_t i = begin; i < end; i++) {
+                    TraitImpl impl{first[i]};
+                    fn(impl);
+                }
+            }, [](std::size_t begin, std::size_t end) {
+                return begin + (end - begin) / 2;
+            });
+        }
+
+        template<class Trait, class Base, class Fn>
+        void __parallel_bucket(std::vector<Base> &items, std::size_t start, std::size_t begin, std::size_t end, Fn &fn) {
+            using TraitImpl = typename is_trait_h<Base, Trait>::TraitImpl;
+            std::size_t from = std::max(begin, start);
+            std::size_t to = std::min(end, start + items.size());
+            for (std::size_t i = from; i < to; i++) {
+                TraitImpl impl{items[i - start]};
+                fn(impl);
+            }
+        }
+
+        // TraitVec: all buckets form one loop, split at bucket boundaries
+        // when possible, and fn gets the final TraitImpl as in for_each
+        template<class Trait, class ...Types, class Fn>
+        void parallel_for_each(ThreadPool &pool, TraitVec<Trait, Types...> &vec, Fn &&fn) {
+            const std::size_t sizes[] = {std::get<std::vector<Types>>(vec.buckets).size()...};
+            std::size_t starts[sizeof...(Types) + 1] = {0};
+            for (std::size_t i = 0; i < sizeof...(Types); i++) {
+                starts[i + 1] = starts[i] + sizes[i];
+            }
+            auto same = [&starts](std::size_t i) {
+                return std::find(std::begin(starts), std::end(starts), i) == std::end(starts);
+            };
+            pool.run(starts[sizeof...(Types)], [&vec, &starts, &fn](std::size_t begin, std::size_t end) {
+                std::size_t bucket = 0;
+                using __expand = int[];
+                (void)__expand{0, (__parallel_bucket<Trait>(std::get<std::vector<Types>>(vec.buckets),
+                                                            starts[bucket], begin, end, fn), bucket++, 0)...};
+            }, [&same](std::size_t begin, std::size_t end) {
+                return __split_at_run(begin, end, same);
+            });
+        }
+
+        template<class Range, class Fn>
+        void parallel_for_each(Range &range, Fn &&fn) {
+            parallel_for_each(ThreadPool::global(), range, std::forward<Fn>(fn));
+        }
+
+        template<class Trait, class Range, class Fn>
+        void parallel_for_each(Range &range, Fn &&fn) {
+            parallel_for_each<Trait>(ThreadPool::global(), range, std::forward<Fn>(fn));
+        }
+
+        // Bounded ring of owned trait objects between threads, after
+        // D. Vyukov's bounded queue: every slot carries a sequence number
+        // that tells producers and the consumer whose turn it is, so the
+        // fast path is one atomic load and store per side, plus a CAS on
+        // the tail when MultiProducer. There is a single consumer.
+        // A slot holds a TraitUPtr moved in by push, or an object emplace
+        // constructed in the slot itself; such an object is popped as a
+        // TraitUPtr whose deleter hands the slot back to the producers, so
+        // it keeps its slot until it is destroyed and the channel has to
+        // outlive it. push and pop wait by yielding; close() lets pop return
+        // false once the remaining objects are drained
+        template<class Trait, bool MultiProducer = false, std::size_t InlineBytes = 4 * sizeof(void*)>
+        struct channel final {
+            struct __Slot {
+                std::atomic<std::size_t> sequence;
+                std::size_t next;
+                Trait *object;
+                void (*deleter)(Trait*);
+                void (*destroy)(Trait*);
+                alignas(std::max_align_t) char storage[InlineBytes];
+            };
+
+            template<class Base>
+            constexpr static bool stores_inline = sizeof(TraitUPtrDirect<Trait, Base>) <= InlineBytes &&
+                                                  alignof(TraitUPtrDirect<Trait, Base>) <= alignof(std::max_align_t);
+
+            std::unique_ptr<__Slot[]> slots;
+            std::size_t mask;
+            std::atomic<bool> closed{false};
+            // Written by the producers and the consumer, on separate cache lines
+            alignas(64) std::atomic<std::size_t> tail{0};
+            alignas(64) std::size_t head = 0;
+
+            // capacity is rounded up to a power of two
+            explicit channel(std::size_t capacity) {
+                std::size_t size = 2;
+                while (size < capacity) {
+                    size *= 2;
+                }
+                slots.reset(new __Slot[size]);
+                mask = size - 1;
+                for (std::size_t i = 0; i < size; i++) {
+                    slots[i].sequence.store(i, std::memory_order_relaxed);
+                }
+            }
+            channel(channel&) = delete;
+            channel& operator=(channel&) = delete;
+            ~channel() {
+                TraitUPtr<Trait> item{nullptr, nullptr};
+                while (try_pop(item)) {
+                    item.reset();
+                }
+            }
+
+            std::size_t capacity() const noexcept {
+                return mask + 1;
+            }
+
+            void close() noexcept {
+                closed.store(true, std::memory_order_release);
+            }
+
+            // Moves item in unless the channel is full
+            bool try_push(TraitUPtr<Trait> &&item) {
+                std::size_t count = 1;
+                std::size_t position = __claim(count);
+                if (!count) {
+                    return false;
+                }
+                __publish(position, item.release(), item.get_deleter());
+                return true;
+            }
+
+            void push(TraitUPtr<Trait> &&item) {
+                while (!try_push(std::move(item))) {
+                    std::this_thread::yield();
+                }
+            }
+
+            // Constructs Base in a free slot when it fits in InlineBytes,
+            // otherwise allocates it like trait::make
+            template<class Base, class ...Args>
+            bool try_emplace(Args &&...args) {
+                static_assert(is_trait<Base, Trait>, "trait not implemented for this type");
+                using Object = TraitUPtrDirect<Trait, Base>;
+                std::size_t count = 1;
+                std::size_t position = __claim(count);
+                if (!count) {
+                    return false;
+                }
+                __Slot &slot = slots[position & mask];
+                try {
+                    __construct<Object>(slot, std::integral_constant<bool, stores_inline<Base>>(),
+                                        std::forward<Args>(args)...);
+                } catch (...) {
+                    // The slot is claimed already: publish it empty, pop skips it
+                    __publish(position, nullptr, nullptr);
+                    throw;
+                }
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+
+            template<class Base, class ...Args>
+            void emplace(Args &&...args) {
+                while (!try_emplace<Base>(std::forward<Args>(args)...)) {
+                    std::this_thread::yield();
+                }
+            }
+
+            // Moves count items from first on, claiming as many slots at
+            // once as are free
+            template<class Iterator>
+            void push_n(Iterator first, std::size_t count) {
+                while (count) {
+                    std::size_t claimed = count;
+                    std::size_t position = __claim(claimed);
+                    if (!claimed) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    for (std::size_t i = 0; i < claimed; i++, ++first) {
+                        TraitUPtr<Trait> &item = *first;
+                        __publish(position + i, item.release(), item.get_deleter());
+                    }
+                    count -= claimed;
+                }
+            }
+
+            // Consumer side
+            bool try_pop(TraitUPtr<Trait> &out) {
+                while (__ready()) {
+                    TraitUPtr<Trait> item = __take();
+                    if (item) {
+                        out = std::move(item);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Waits for an object; false once the channel is closed and empty.
+            // Objects emplaced in the channel keep their slots until they are
+            // destroyed, so a consumer holding capacity() of them waits forever
+            bool pop(TraitUPtr<Trait> &out) {
+                while (!try_pop(out)) {
+                    if (closed.load(std::memory_order_acquire)) {
+                        return try_pop(out);
+                    }
+                    std::this_thread::yield();
+                }
+                return true;
+            }
+
+            // Appends up to count objects that are ready to out
+            std::size_t try_pop_n(std::vector<TraitUPtr<Trait>> &out, std::size_t count) {
+                std::size_t popped = 0;
+                while (popped < count && __ready()) {
+                    TraitUPtr<Trait> item = __take();
+                    if (item) {
+                        out.push_back(std::move(item));
+                        popped++;
+                    }
+                }
+                return popped;
+            }
+
+            // Waits for at least one object, then appends up to count
+            // objects to out; 0 once the channel is closed and empty
+            std::size_t pop_n(std::vector<TraitUPtr<Trait>> &out, std::size_t count) {
+                std::size_t popped;
+                while (!(popped = try_pop_n(out, count))) {
+                    if (closed.load(std::memory_order_acquire)) {
+                        return try_pop_n(out, count);
+                    }
+                    std::this_thread::yield();
+                }
+                return popped;
+            }
+
+            // Claims up to count consecutive free slots and returns the
+            // position of the first one; count is set to the number claimed,
+            // 0 when the channel is full
+            std::size_t __claim(std::size_t &count) {
+                std::size_t position = tail.load(std::memory_order_relaxed);
+                for (;;) {
+                    std::size_t free = 0;
+                    while (free < count &&
+                           slots[(position + free) & mask].sequence.load(std::memory_order_acquire) == position + free) {
+                        free++;
+                    }
+                    if (!free) {
+                        std::size_t sequence = slots[position & mask].sequence.load(std::memory_order_acquire);
+                        if (static_cast<std::ptrdiff_t>(sequence - position) < 0) {
+                            count = 0;
+                            return position;
+                        }
+                        // Another producer took this position
+                        position = tail.load(std::memory_order_relaxed);
+                        continue;
+                    }
+                    if (!MultiProducer) {
+                        tail.store(position + free, std::memory_order_relaxed);
+                        count = free;
+                        return position;
+                    }
+                    if (tail.compare_exchange_weak(position, position + free,
+                                                   std::memory_order_relaxed, std::memory_order_relaxed)) {
+                        count = free;
+                        return position;
+                    }
+                }
+            }
+
+            template<class Object, class ...Args>
+            static void __construct(__Slot &slot, std::true_type, Args &&...args) {
+                slot.object = (new(slot.storage) Object{std::forward<Args>(args)...})->trait();
+                slot.deleter = __release;
+                slot.destroy = [](Trait *trait) {
+                    Object::of(trait)->~Object();
+                };
+            }
+
+            template<class Object, class ...Args>
+            static void __construct(__Slot &slot, std::false_type, Args &&...args) {
+                slot.object = Object::make(std::forward<Args>(args)...);
+                slot.deleter = __TraitUPtrHeader<Trait>::deleter;
+            }
+
+            void __publish(std::size_t position, Trait *object, void (*deleter)(Trait*)) noexcept {
+                __Slot &slot = slots[position & mask];
+                slot.object = object;
+                slot.deleter = deleter;
+                slot.sequence.store(position + 1, std::memory_order_release);
+            }
+
+            bool __ready() const noexcept {
+                return slots[head & mask].sequence.load(std::memory_order_acquire) == head + 1;
+            }
+
+            // Takes the object at head, null for a failed emplace. The slot
+            // goes back to the producers now, or when the object constructed
+            // in it is destroyed
+            TraitUPtr<Trait> __take() noexcept {
+                __Slot &slot = slots[head & mask];
+                TraitUPtr<Trait> item{slot.object, slot.deleter};
+                std::size_t next = head + mask + 1;
+                head++;
+                // The deleter alone cannot tell, an object emplaced in
+                // another channel of this type may have been pushed here
+                if (reinterpret_cast<char*>(slot.object) == slot.storage + sizeof(__TraitUPtrHeader<Trait>)) {
+                    slot.next = next;
+                } else {
+                    slot.sequence.store(next, std::memory_order_release);
+                }
+                return item;
+            }
+
+            static void __release(Trait *trait) {
+                char *storage = reinterpret_cast<char*>(__TraitUPtrHeader<Trait>::of(trait));
+                __Slot *slot = reinterpret_cast<__Slot*>(storage - offsetof(__Slot, storage));
+                slot->destroy(trait);
+                slot->sequence.store(slot->next, std::memory_order_release);
+            }
+        };
+
+        template<class Trait, std::size_t InlineBytes = 4 * sizeof(void*)>
+        using spsc_channel = channel<Trait, false, InlineBytes>;
+
+        template<class Trait, std::size_t InlineBytes = 4 * sizeof(void*)>
+        using mpsc_channel = channel<Trait, true, InlineBytes>;
+
+        // Rust's Iterator. next stores the next item in out and returns
+        // false at the end; next_chunk stores up to count items and returns
+        // how many, fewer than count only at the end. Items are assigned to
+        // existing objects, so Item must be default constructible
+        template<class Item>
+        struct Iterator {
+            static_assert(std::is_default_constructible<Item>::value,
+                          "Iterator writes items through next(Item&), Item must be default constructible");
+            virtual bool next(Item &out) = 0;
+            virtual std::size_t next_chunk(Item *out, std::size_t count) {
+                std::size_t n = 0;
+                while (n < count && next(out[n])) {
+                    n++;
+                }
+                return n;
+            }
+        };
+
+        // Every impl of Iterator gets a next_chunk that calls its own next
+        // statically, so one virtual call yields a whole chunk
+        template<class Item, class Self>
+        struct __TraitImplBase<Iterator<Item>, Self>: public Iterator<Item> {
+            using __Self = Self;
+            using __Trait = Iterator<Item>;
+            __Self &self;
+            explicit __TraitImplBase(__Self &self_) noexcept : self(self_) {}
+            explicit __TraitImplBase(__Self &&self_) noexcept : self(self_) {}
+
+            std::size_t next_chunk(Item *out, std::size_t count) override {
+                using TraitImpl = typename is_trait_h<Self, Iterator<Item>>::TraitImpl;
+                auto &impl = static_cast<TraitImpl&>(*this);
+                std::size_t n = 0;
+                while (n < count && impl.next(out[n])) {
+                    n++;
+                }
+                return n;
+            }
+        };
+
+        constexpr std::size_t __iter_chunk = 64;
+
+        // Adaptors are pushed into one loop: a stage wraps the sink of the
+        // stage after it and drives the stage before it. __bound() of a
+        // sink is how many more items it may take from the source, so a
+        // chunk never reads past the end of a take
+        template<class Acc, class Fn>
+        struct __IterFold {
+            Acc &acc;
+            Fn &fn;
+            std::size_t __bound() const noexcept {
+                return std::size_t(-1);
+            }
+            template<class T>
+            void operator()(T &&item) {
+                acc = fn(std::move(acc), std::forward<T>(item));
+            }
+        };
+
+        template<class Derived>
+        struct __IterAdaptors {
+            template<class Fn>
+            auto map(Fn fn) const;
+
+            template<class Fn>
+            auto filter(Fn fn) const;
+
+            auto take(std::size_t count) const;
+
+            template<class Acc, class Fn>
+            Acc fold(Acc init, Fn fn) const {
+                __IterFold<Acc, Fn> sink{init, fn};
+                Derived(static_cast<const Derived&>(*this)).__drive(sink);
+                return init;
+            }
+        };
+
+        // Source is the final TraitImpl of a concrete iterator, whose next
+        // binds statically, or an Iterator<Item>& read a chunk at a time
+        template<class Item, class Source>
+        struct __IterSource final: public __IterAdaptors<__IterSource<Item, Source>> {
+            Source source;
+
+            explicit __IterSource(Source source_) : source(source_) {}
+
+            template<class Sink>
+            void __drive(Sink &sink) {
+                __drive(sink, std::is_reference<Source>());
+            }
+
+            template<class Sink>
+            void __drive(Sink &sink, std::false_type) {
+                Item item;
+                while (sink.__bound() && source.next(item)) {
+                    sink(std::move(item));
+                }
+            }
+
+            // The chunk is default constructed once per drive and reused,
+            // which costs nothing for trivial items
+            template<class Sink>
+            void __drive(Sink &sink, std::true_type) {
+                Item items[__iter_chunk];
+                for (;;) {
+                    std::size_t count = std::min(__iter_chunk, sink.__bound());
+                    if (!count) {
+                        return;
+                    }
+                    std::size_t n = source.next_chunk(items, count);
+                    for (std::size_t i = 0; i < n; i++) {
+                        sink(std::move(items[i]));
+                    }
+                    if (n < count) {
+                        return;
+                    }
+                }
+            }
+        };
+
+        template<class Inner, class Fn>
+        struct __IterMap final: public __IterAdaptors<__IterMap<Inner, Fn>> {
+            Inner inner;
+            Fn fn;
+
+            __IterMap(const Inner &inner_, Fn fn_) : inner(inner_), fn(std::move(fn_)) {}
+
+            template<class Sink>
+            struct __Sink {
+                Sink &sink;
+                Fn &fn;
+                std::size_t __bound() const noexcept {
+                    return sink.__bound();
+                }
+                template<class T>
+                void operator()(T &&item) {
+                    sink(fn(std::forward<T>(item)));
+                }
+            };
+
+            template<class Sink>
+            void __drive(Sink &sink) {
+                __Sink<Sink> mapped{sink, fn};
+                inner.__drive(mapped);
+            }
+        };
+
+        template<class Inner, class Fn>
+        struct __IterFilter final: public __IterAdaptors<__IterFilter<Inner, Fn>> {
+            Inner inner;
+            Fn fn;
+
+            __IterFilter(const Inner &inner_, Fn fn_) : inner(inner_), fn(std::move(fn_)) {}
+
+            template<class Sink>
+            struct __Sink {
+                Sink &sink;
+                Fn &fn;
+                std::size_t __bound() const noexcept {
+                    return sink.__bound();
+                }
+                template<class T>
+                void operator()(T &&item) {
+                    if (fn(static_cast<const std::remove_reference_t<T>&>(item))) {
+                        sink(std::forward<T>(item));
+                    }
+                }
+            };
+
+            template<class Sink>
+            void __drive(Sink &sink) {
+                __Sink<Sink> filtered{sink, fn};
+                inner.__drive(filtered);
+            }
+        };
+
+        template<class Inner>
+        struct __IterTake final: public __IterAdaptors<__IterTake<Inner>> {
+            Inner inner;
+            std::size_t count;
+
+            __IterTake(const Inner &inner_, std::size_t count_) : inner(inner_), count(count_) {}
+
+            template<class Sink>
+            struct __Sink {
+                Sink &sink;
+                std::size_t remaining;
+                std::size_t __bound() const noexcept {
+                    return std::min(remaining, sink.__bound());
+                }
+                template<class T>
+                void operator()(T &&item) {
+                    remaining--;
+                    sink(std::forward<T>(item));
+                }
+            };
+
+            template<class Sink>
+            void __drive(Sink &sink) {
+                __Sink<Sink> taken{sink, count};
+                inner.__drive(taken);
+            }
+        };
+
+        template<class Derived>
+        template<class Fn>
+        auto __IterAdaptors<Derived>::map(Fn fn) const {
+            return __IterMap<Derived, Fn>(static_cast<const Derived&>(*this), std::move(fn));
+        }
+
+        template<class Derived>
+        template<class Fn>
+        auto __IterAdaptors<Derived>::filter(Fn fn) const {
+            return __IterFilter<Derived, Fn>(static_cast<const Derived&>(*this), std::move(fn));
+        }
+
+        template<class Derived>
+        auto __IterAdaptors<Derived>::take(std::size_t count) const {
+            return __IterTake<Derived>(static_cast<const Derived&>(*this), count);
+        }
+
+        // Adaptors over an iterator, resolved like to_trait: a concrete
+        // type runs map/filter/take/fold as one loop over its own next,
+        // a TraitRef, TraitUPtr or handle calls next_chunk once per chunk.
+        // The pipeline refers to the source, which has to outlive it
+        template<class Item, class Source>
+        auto iter(Source &&source) {
+            using Ref = decltype(to_trait<Iterator<Item>>(std::forward<Source>(source)));
+            return __IterSource<Item, Ref>(to_trait<Iterator<Item>>(std::forward<Source>(source)));
+        }
+
+        template<class Item>
+        auto iter(Iterator<Item> &source) {
+            return __IterSource<Item, Iterator<Item>&>(source);
+        }
+
+        // Rust's Eq and Hash for trait objects used as keys. eq is true when
+        // other was made from the same type and holds an equal value, which
+        // an impl checks with try_cast<Self>(other). Hash derives from Eq, so
+        // a key trait is a single chain and keeps one virtual table pointer
+        struct Eq {
+            virtual bool eq(Eq &other) = 0;
+        };
+
+        struct Hash: public Eq {
+            virtual std::size_t hash() = 0;
+        };
+
+        // Open addressing map from owned trait objects to values, probed
+        // linearly. Every slot keeps the hash of its key next to the key
+        // handle: a probe calls eq only when the hashes match, and growing
+        // moves entries without hashing them again. Lookups accept a
+        // concrete Base implementing Key, whose hash and eq bind
+        // statically, as well as a TraitRef, TraitUPtr or Key&
+        template<class Key, class Value>
+        struct TraitHashMap final {
+            static_assert(std::is_base_of<Hash, Key>::value, "key trait must derive from trait::Hash");
+            // Growing and erasing move entries between slots and cannot undo
+            // a move that throws
+            static_assert(std::is_nothrow_move_constructible<Value>::value, "values must be nothrow move constructible");
+
+            struct __Entry {
+                TraitUPtr<Key> key;
+                Value value;
+
+                template<class ...Args>
+                explicit __Entry(TraitUPtr<Key> &&key_, Args &&...args) :
+                        key(std::move(key_)), value(std::forward<Args>(args)...) {}
+            };
+
+            struct __Slot {
+                // 0 when the slot is empty
+                std::size_t hash;
+                alignas(__Entry) char entry[sizeof(__Entry)];
+
+                __Entry &get() noexcept {
+                    return *reinterpret_cast<__Entry*>(entry);
+                }
+            };
+
+            std::unique_ptr<__Slot[]> slots;
+            std::size_t mask = 0;
+            std::size_t count = 0;
+            unsigned shift = 0;
+
+            TraitHashMap() = default;
+            TraitHashMap(TraitHashMap &&other) noexcept :
+                    slots(std::move(other.slots)), mask(other.mask), count(other.count), shift(other.shift) {
+                other.count = 0;
+            }
+            TraitHashMap &operator=(TraitHashMap &&other) noexcept {
+                if (this != &other) {
+                    clear();
+                    slots = std::move(other.slots);
+                    mask = other.mask;
+                    count = other.count;
+                    shift = other.shift;
+                    other.count = 0;
+                }
+                return *this;
+            }
+            ~TraitHashMap() {
+                clear();
+            }
+
+            std::size_t size() const noexcept {
+                return count;
+            }
+
+            bool empty() const noexcept {
+                return !count;
+            }
+
+            std::size_t capacity() const noexcept {
+                return slots ? mask + 1 : 0;
+            }
+
+            void clear() noexcept {
+                for (std::size_t i = 0; count && i <= mask; i++) {
+                    if (slots[i].hash) {
+                        slots[i].get().~__Entry();
+                        slots[i].hash = 0;
+                        count--;
+                    }
+                }
+            }
+
+            // Makes room for size entries without growing again
+            void reserve(std::size_t size) {
+                std::size_t target = 8;
+                while (target / 4 * 3 < size) {
+                    target *= 2;
+                }
+                if (target > capacity()) {
+                    __rehash(target);
+                }
+            }
+
+            // Inserts key with a Value made from args unless an equal key is
+            // present; key is only moved from when it is inserted. An empty
+            // key has no hash and terminates
+            template<class ...Args>
+            std::pair<Value*, bool> emplace(TraitUPtr<Key> &&key, Args &&...args) {
+                if (!key) {
+                    std::terminate();
+                }
+                std::size_t hash = __mix(key->hash());
+                if (__Slot *slot = __find(*key, hash)) {
+                    return std::make_pair(&slot->get().value, false);
+                }
+                reserve(count + 1);
+                __Slot &slot = __vacant(hash);
+                new(slot.entry) __Entry(std::move(key), std::forward<Args>(args)...);
+                slot.hash = hash;
+                count++;
+                return std::make_pair(&slot.get().value, true);
+            }
+
+            template<class Probe>
+            Value *find(Probe &&probe) {
+                auto &&key = __probe(std::forward<Probe>(probe));
+                __Slot *slot = __find(key, __mix(key.hash()));
+                return slot ? &slot->get().value : nullptr;
+            }
+
+            template<class Probe>
+            bool contains(Probe &&probe) {
+                return find(std::forward<Probe>(probe)) != nullptr;
+            }
+
+            template<class Probe>
+            bool erase(Probe &&probe) {
+                auto &&key = __probe(std::forward<Probe>(probe));
+                __Slot *slot = __find(key, __mix(key.hash()));
+                if (!slot) {
+                    return false;
+                }
+                std::size_t hole = slot - slots.get();
+                slot->get().~__Entry();
+                slot->hash = 0;
+                count--;
+                // Shifts back the entries after the hole that may live in it,
+                // so probes never need tombstones
+                for (std::size_t i = (hole + 1) & mask; slots[i].hash; i = (i + 1) & mask) {
+                    std::size_t home = slots[i].hash >> shift;
+                    if (((i - home) & mask) >= ((i - hole) & mask)) {
+                        __move(slots[i], slots[hole]);
+                        hole = i;
+                    }
+                }
+                return true;
+            }
+
+            // fn(Key&, Value&) for every entry, in no particular order
+            template<class Fn>
+            void for_each(Fn &&fn) {
+                for (std::size_t i = 0; slots && i <= mask; i++) {
+                    if (slots[i].hash) {
+                        fn(*slots[i].get().key, slots[i].get().value);
+                    }
+                }
+            }
+
+            // Fibonacci hashing: the top bits of the product pick the slot,
+            // so weak hashes such as the identity of an int still spread
+            static std::size_t __mix(std::size_t hash) noexcept {
+                hash *= static_cast<std::size_t>(0x9e3779b97f4a7c15ull);
+                return hash ? hash : 1;
+            }
+
+            // The final TraitImpl of a concrete Base, or the trait object
+            template<class Probe>
+            static decltype(auto) __probe(Probe &&probe) {
+                return to_trait<Key>(std::forward<Probe>(probe));
+            }
+
+            static Key &__probe(Key &probe) noexcept {
+                return probe;
+            }
+
+            template<class Probe>
+            __Slot *__find(Probe &key, std::size_t hash) {
+                if (!count) {
+                    return nullptr;
+                }
+                for (std::size_t i = hash >> shift;; i = (i + 1) & mask) {
+                    __Slot &slot = slots[i];
+                    if (!slot.hash) {
+                        return nullptr;
+                    }
+                    if (slot.hash == hash && key.eq(*slot.get().key)) {
+                        return &slot;
+                    }
+                }
+            }
+
+            __Slot &__vacant(std::size_t hash) noexcept {
+                std::size_t i = hash >> shift;
+                while (slots[i].hash) {
+                    i = (i + 1) & mask;
+                }
+                return slots[i];
+            }
+
+            static void __move(__Slot &from, __Slot &to) noexcept {
+                new(to.entry) __Entry(std::move(from.get()));
+                to.hash = from.hash;
+                from.get().~__Entry();
+                from.hash = 0;
+            }
+
+            void __rehash(std::size_t size) {
+                std::unique_ptr<__Slot[]> old(new __Slot[size]());
+                std::size_t old_size = capacity();
+                std::swap(old, slots);
+                mask = size - 1;
+                shift = 8 * sizeof(std::size_t);
+                while (size > 1) {
+                    size /= 2;
+                    shift--;
+                }
+                for (std::size_t i = 0; i < old_size; i++) {
+                    if (old[i].hash) {
+                        __move(old[i], __vacant(old[i].hash));
+                    }
+                }
+            }
+        };
+
+#if TRAIT_COROUTINES
+        // Recycles coroutine frames of Task. Freed frames go to free lists
+        // per size class holding at most limit frames each, so repeated
+        // calls reuse the same memory instead of the global allocator.
+        // Not thread safe: by default a frame comes from the pool of the
+        // current thread, local(); a Task taking a FramePool& argument
+        // allocates its frame from that pool instead
+        struct FramePool final {
+            constexpr static std::size_t granularity = 64;
+            constexpr static std::size_t size_classes = 32;
+            constexpr static std::size_t limit = 64;
+            void *free_lists[size_classes] = {};
+            std::size_t counts[size_classes] = {};
+
+            FramePool() = default;
+            FramePool(FramePool&) = delete;
+            FramePool& operator=(FramePool&) = delete;
+            ~FramePool() {
+                for (void *p : free_lists) {
+                    while (p) {
+                        void *next = *static_cast<void**>(p);
+                        ::operator delete(p);
+                        p = next;
+                    }
+                }
+            }
+
+            void *allocate(std::size_t size) {
+                if (size > size_classes * granularity) {
+                    return ::operator new(size);
+                }
+                std::size_t index = (size - 1) / granularity;
+                if (void *p = free_lists[index]) {
+                    free_lists[index] = *static_cast<void**>(p);
+                    counts[index]--;
+                    return p;
+                }
+                return ::operator new((index + 1) * granularity);
+            }
+
+            void deallocate(void *p, std::size_t size) noexcept {
+                std::size_t index = (size - 1) / granularity;
+                if (size > size_classes * granularity || counts[index] == limit) {
+                    ::operator delete(p);
+                    return;
+                }
+                *static_cast<void**>(p) = free_lists[index];
+                free_lists[index] = p;
+                counts[index]++;
+            }
+
+            // nullptr once the pool of the current thread is destroyed
+            static FramePool *local() noexcept {
+                struct Local {
+                    FramePool pool;
+                    bool alive = true;
+                    ~Local() {
+                        alive = false;
+                    }
+                };
+                thread_local Local local;
+                return local.alive ? &local.pool : nullptr;
+            }
+        };
+
+        template<class ...Rest>
+        FramePool *__frame_pool(FramePool &pool, Rest &...) noexcept {
+            return &pool;
+        }
+
+        inline FramePool *__frame_pool() noexcept {
+            return nullptr;
+        }
+
+        template<class First, class ...Rest>
+        FramePool *__frame_pool(First &, Rest &...rest) noexcept {
+            return __frame_pool(rest...);
+        }
+
+        template<class T>
+        struct Task;
+
+        // Every frame starts with a header naming its pool, nullptr for the
+        // pool of the thread that destroys it
+        struct __TaskPromiseBase {
+            constexpr static std::size_t __header = alignof(std::max_align_t) > sizeof(void*) ?
+                                                    alignof(std::max_align_t) : sizeof(void*);
+            std::coroutine_handle<> continuation;
+            std::exception_ptr exception;
+
+            struct __FinalAwaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+                template<class Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                    std::coroutine_handle<> continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+            __FinalAwaiter final_suspend() noexcept {
+                return {};
+            }
+            void unhandled_exception() noexcept {
+                exception = std::current_exception();
+            }
+
+            template<class ...Args>
+            static void *operator new(std::size_t size, Args &...args) {
+                FramePool *pool = __frame_pool(args...);
+                FramePool *from = pool ? pool : FramePool::local();
+                char *frame = static_cast<char*>(from ? from->allocate(size + __header) : ::operator new(size + __header));
+                *reinterpret_cast<FramePool**>(frame) = pool;
+                return frame + __header;
+            }
+
+            static void operator delete(void *p, std::size_t size) noexcept {
+                char *frame = static_cast<char*>(p) - __header;
+                FramePool *pool = *reinterpret_cast<FramePool**>(frame);
+                FramePool *to = pool ? pool : FramePool::local();
+                if (to) {
+                    to->deallocate(frame, size + __header);
+                } else {
+                    ::operator delete(frame);
+                }
+            }
+        };
+
+        template<class T>
+        struct __TaskPromise: __TaskPromiseBase {
+            std::optional<T> value;
+            Task<T> get_return_object() noexcept;
+            template<class U>
+            void return_value(U &&result) {
+                value.emplace(std::forward<U>(result));
+            }
+        };
+
+        template<>
+        struct __TaskPromise<void>: __TaskPromiseBase {
+            Task<void> get_return_object() noexcept;
+            void return_void() noexcept {}
+        };
+
+        // Lazy coroutine result for async trait methods, for example
+        //   virtual trait::Task<int> read(int key) = 0;
+        // The coroutine starts when the Task is awaited or run by an
+        // Executor, and resumes the awaiting coroutine by symmetric
+        // transfer when it finishes. The trait object the method was called
+        // on must outlive the Task
+        template<class T = void>
+        struct Task final {
+            using promise_type = __TaskPromise<T>;
+            std::coroutine_handle<promise_type> handle;
+
+            explicit Task(std::coroutine_handle<promise_type> handle_) noexcept : handle(handle_) {}
+            Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+            Task& operator=(Task &&other) noexcept {
+                if (this != &other) {
+                    if (handle) {
+                        handle.destroy();
+                    }
+                    handle = std::exchange(other.handle, nullptr);
+                }
+                return *this;
+            }
+            Task(Task&) = delete;
+            Task& operator=(Task&) = delete;
+            ~Task() {
+                if (handle) {
+                    handle.destroy();
+                }
+            }
+
+            bool done() const noexcept {
+                return handle.done();
+            }
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+                handle.promise().continuation = caller;
+                return handle;
+            }
+            T await_resume() {
+                return get();
+            }
+
+            // Result of a finished Task; rethrows its exception
+            T get() {
+                if (!handle.done()) {
+                    throw std::logic_error("trait::Task::get: task is not finished");
+                }
+                if (handle.promise().exception) {
+                    std::rethrow_exception(handle.promise().exception);
+                }
+                if constexpr (!std::is_void_v<T>) {
+                    return std::move(*handle.promise().value);
+                }
+            }
+        };
+
+        template<class T>
+        Task<T> __TaskPromise<T>::get_return_object() noexcept {
+            return Task<T>{std::coroutine_handle<__TaskPromise>::from_promise(*this)};
+        }
+
+        inline Task<void> __TaskPromise<void>::get_return_object() noexcept {
+            return Task<void>{std::coroutine_handle<__TaskPromise>::from_promise(*this)};
+        }
+
+        // Single-threaded executor: a FIFO queue of coroutines ready to
+        // resume. run() resumes them until the queue is empty
+        struct Executor final {
+            std::deque<std::coroutine_handle<>> ready;
+            std::vector<Task<void>> tasks;
+
+            Executor() = default;
+            Executor(Executor&) = delete;
+            Executor& operator=(Executor&) = delete;
+
+            // Keeps task until it finishes; its exception is rethrown by run()
+            void spawn(Task<void> task) {
+                ready.push_back(task.handle);
+                tasks.push_back(std::move(task));
+            }
+
+            // Queues a suspended coroutine, e.g. from a completion callback
+            void post(std::coroutine_handle<> handle) {
+                ready.push_back(handle);
+            }
+
+            // co_await executor.yield() lets the other ready coroutines run
+            auto yield() noexcept {
+                struct Awaiter {
+                    Executor &executor;
+                    bool await_ready() const noexcept {
+                        return false;
+                    }
+                    void await_suspend(std::coroutine_handle<> handle) {
+                        executor.ready.push_back(handle);
+                    }
+                    void await_resume() const noexcept {}
+                };
+                return Awaiter{*this};
+            }
+
+            void run() {
+                while (!ready.empty()) {
+                    std::coroutine_handle<> handle = ready.front();
+                    ready.pop_front();
+                    handle.resume();
+                }
+                auto finished = std::partition(tasks.begin(), tasks.end(), [](Task<void> &task) {
+                    return !task.done();
+                });
+                std::vector<Task<void>> results(std::make_move_iterator(finished), std::make_move_iterator(tasks.end()));
+                tasks.erase(finished, tasks.end());
+                for (auto &task : results) {
+                    task.get();
+                }
+            }
+
+            // Runs until task finishes and returns its result. A task still
+            // waiting for work outside the executor once nothing is ready
+            // cannot finish here, that throws std::logic_error and destroys
+            // the task, so nothing may resume it afterwards
+            template<class T>
+            T block_on(Task<T> task) {
+                ready.push_back(task.handle);
+                run();
+                if (!task.done()) {
+                    throw std::logic_error("trait::Executor::block_on: task is waiting for work outside the executor");
+                }
+                return task.get();
+            }
+        };
+#endif
+    }
+    }
+    using __impl::is_trait;
+    using __impl::to_trait;
+    using __impl::cast;
+    using __impl::try_cast;
+    using __impl::dispatch_likely;
+    using __impl::type_id;
+    using __impl::TraitTypeId;
+    using __impl::TraitRef;
+    using __impl::TraitRefCompact;
+    using __impl::TraitUPtr;
+    using __impl::own;
+    using __impl::make;
+    using __impl::clone;
+    using __impl::clone_all;
+    using __impl::TraitShared;
+    using __impl::TraitWeak;
+    using __impl::TraitArc;
+    using __impl::TraitRc;
+    using __impl::own_arc;
+    using __impl::make_arc;
+    using __impl::own_rc;
+    using __impl::make_rc;
+    using __impl::TraitBox;
+    using __impl::own_box;
+    using __impl::make_box;
+    using __impl::MonotonicArena;
+    using __impl::PoolArena;
+    using __impl::SharedPool;
+    using __impl::own_in;
+    using __impl::make_in;
+    using __impl::own_pooled;
+    using __impl::make_pooled;
+    using __impl::emplace_in;
+    using __impl::TraitValue;
+    using __impl::TraitVec;
+    using __impl::TraitEnum;
+    using __impl::Dyn;
+    using __impl::registry;
+    using __impl::TraitCodec;
+    using __impl::TraitRecordHeader;
+    using __impl::TraitMapped;
+    using __impl::mapped_size;
+    using __impl::emplace_mapped;
+    using __impl::own_value;
+    using __impl::make_value;
+    using __impl::trait_assert;
+    using __impl::is_trait_h;
+#if TRAIT_BACKEND >= 20
+    using __impl::implements;
+#endif
+    using __impl::ThreadPool;
+    using __impl::parallel_for_each;
+    using __impl::channel;
+    using __impl::spsc_channel;
+    using __impl::mpsc_channel;
+    using __impl::Iterator;
+    using __impl::iter;
+    using __impl::Eq;
+    using __impl::Hash;
+    using __impl::TraitHashMap;
+#if TRAIT_PROFILE
+    using __impl::ProfileEntry;
+    using __impl::profile_snapshot;
+    using __impl::profile_reset;
+    using __impl::profile_dump;
+#endif
+#if TRAIT_COROUTINES
+    using __impl::Task;
+    using __impl::FramePool;
+    using __impl::Executor;
+#endif
+}
+
+template<typename Base, typename Trait, typename R, typename ...Args,
+         typename __assert=trait::trait_assert<Base, Trait>>
+auto operator->*(Base &&base, R (Trait::*ptr)(Args...)) {
+    // Args are fixed by the method, take them as the method does so
+    // lvalues bind to by-value parameters
+    return [&base, ptr](Args ...args)->decltype(auto) {
+        return (trait::to_trait<Trait>(std::forward<Base>(base)).*ptr)(std::forward<Args>(args)...);
+    };
+}
+
+template<class Trait, class Self, class ...RequiredTraits>
+struct __TraitImpl final: public trait::__impl::__TraitImplBase<Trait, Self> {
+    using __noimpl = decltype(Trait());
+};
+
+#define TRAIT_COMMA ,
 #define TRAIT_PARA(...) __VA_ARGS__
 
 #define IMPL_TRAIT_FOR_CLASS(TraitCls, BaseCls) \
@@ -369,7 +4749,55 @@ struct __TraitImpl<TraitCls, BaseCls, ::trait::__impl::__is_trait_h_conj<__VA_AR
 
 #define TRAIT_BOUND(Trait, ...) trait::is_trait_h<Trait, __VA_ARGS__>
 
+// Statement counting the calls of the enclosing impl method with TRAIT_PROFILE
+#if TRAIT_PROFILE
+#define TRAIT_PROFILE_SCOPE \
+    static const ::std::size_t __trait_profile_site = \
+        ::trait::__impl::__profile_site<::std::remove_cv_t<::std::remove_pointer_t<decltype(this)>>>(__func__);\
+    ::trait::__impl::__ProfileScope __trait_profile_scope(__trait_profile_site)
+#else
+#define TRAIT_PROFILE_SCOPE static_cast<void>(0)
+#endif
+
+#define TRAIT_DYN_METHOD(...) ::trait::__impl::__DynMethod<decltype(__VA_ARGS__), __VA_ARGS__>
+
+#define TRAIT_DYN_FN(...) TRAIT_DYN_METHOD(__VA_ARGS__)()
+
+#define TRAIT_DYN(TraitCls, ...) \
+template<> \
+struct trait::__impl::__TraitDynMethods<TraitCls> { \
+    using type = ::trait::__impl::__DynMethods<__VA_ARGS__>; \
+}
+
+#define TRAIT_REGISTER(TraitCls, BaseCls, TagValue) \
+template<> \
+struct trait::__impl::__TraitRegistration<TraitCls, BaseCls> { \
+    constexpr static ::std::uint32_t tag = TagValue; \
+    constexpr static const bool *registered = &::trait::__impl::__TraitRegistrar<TraitCls, BaseCls>::registered; \
+}
+
+
+#if TRAIT_BACKEND >= 20
+template<class Trait, class TraitImpl>
+    requires std::is_base_of_v<Trait, typename trait::__impl::__TraitImplConcept<TraitImpl>::Trait>
+TraitImpl __trait_impl(::trait::__impl::__TraitTypeCheck<Trait>, TraitImpl*);
+
 
+template<class Trait, class Trait2>
+    requires std::is_base_of_v<Trait2, Trait>
+trait::TraitRef<Trait> __trait_impl(::trait::__impl::__TraitTypeCheck<Trait2>, trait::TraitRef<Trait>*);
+
+
+template<class Trait, class Trait2>
+    requires std::is_base_of_v<Trait2, Trait>
+trait::TraitRef<Trait> __trait_impl(::trait::__impl::__TraitTypeCheck<Trait2>, trait::TraitUPtr<Trait>*);
+
+
+template<class Trait2, class Handle,
+         class HandleTrait=typename trait::__impl::__TraitHandleTraits<Handle>::Trait>
+    requires std::is_base_of_v<Trait2, HandleTrait>
+trait::TraitRef<HandleTrait> __trait_impl(::trait::__impl::__TraitTypeCheck<Trait2>, Handle*);
+#else
 template<class Trait, class TraitImpl>
 std::enable_if_t<std::is_base_of<Trait, typename trait::__impl::__TraitImplConcept<TraitImpl>::Trait>::value, TraitImpl>
     __trait_impl(::trait::__impl::__TraitTypeCheck<Trait>, TraitImpl*);
@@ -383,3 +4811,10 @@ std::enable_if_t<std::is_base_of<Trait2, Trait>::value, trait::TraitRef<Trait>>
 template<class Trait, class Trait2>
 std::enable_if_t<std::is_base_of<Trait2, Trait>::value, trait::TraitRef<Trait>>
     __trait_impl(::trait::__impl::__TraitTypeCheck<Trait2>, trait::TraitUPtr<Trait>*);
+
+
+template<class Trait2, class Handle,
+         class HandleTrait=typename trait::__impl::__TraitHandleTraits<Handle>::Trait>
+std::enable_if_t<std::is_base_of<Trait2, HandleTrait>::value, trait::TraitRef<HandleTrait>>
+    __trait_impl(::trait::__impl::__TraitTypeCheck<Trait2>, Handle*);
+#endif
@@ -1,6 +1,19 @@
+#include <csignal>
+#include <cstdio>
 #include <functional>
 #include <type_traits>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <vector>
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include "rust_trait.h"
 
 
@@ -76,6 +89,28 @@ IMPL_TRAIT_FOR_CLASS(TraitA, std::unique_ptr<float>) {
     }
 };
 
+TRAIT_DYN(TraitA, TRAIT_DYN_METHOD(&TraitA::test), TRAIT_DYN_METHOD(&TraitA::test2));
+
+// Read through Dyn<const Measure>, also appended to through Dyn<Measure>
+struct Measure {
+    virtual std::size_t length() const = 0;
+    virtual void append(char c) = 0;
+};
+
+IMPL_TRAIT_FOR_CLASS(Measure, std::string) {
+    TRAIT_FOR_CLASS_SELF;
+    std::size_t length() const override {
+        return self.size();
+    }
+    void append(char c) override {
+        self.push_back(c);
+    }
+};
+
+TRAIT_DYN(Measure, TRAIT_DYN_METHOD(&Measure::length), TRAIT_DYN_METHOD(&Measure::append));
+
+TRAIT_REGISTER(TraitA, int, 0);
+
 struct TraitB {
     virtual void test3() = 0;
 };
@@ -127,6 +162,42 @@ IMPL_TRAIT_FOR_CLASS(TraitD, Test3) {
     }
 };
 
+TRAIT_REGISTER(TraitA, Test3, 1);
+
+#if TRAIT_COROUTINES
+struct AsyncRead {
+    virtual trait::Task<int> read(int key) = 0;
+    virtual trait::Task<int> read_in(trait::FramePool &pool, int key) = 0;
+};
+
+trait::Executor executor;
+
+IMPL_TRAIT_FOR_CLASS(AsyncRead, int) {
+    TRAIT_FOR_CLASS_SELF;
+    trait::Task<int> read(int key) override {
+        co_return self + key;
+    }
+    trait::Task<int> read_in(trait::FramePool &, int key) override {
+        co_return self * key;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(AsyncRead, Test3) {
+    TRAIT_FOR_CLASS_SELF;
+    trait::Task<int> read(int key) override {
+        co_await executor.yield();
+        int inner = co_await trait::to_trait<AsyncRead>(key).read(1);
+        co_return inner * 10;
+    }
+    trait::Task<int> read_in(trait::FramePool &pool, int key) override {
+        if (key < 0) {
+            throw key;
+        }
+        co_return co_await trait::to_trait<AsyncRead>(key).read_in(pool, 2);
+    }
+};
+#endif
+
 
 struct Odd {
     virtual int number() = 0;
@@ -260,6 +331,219 @@ IMPL_TRAIT_FOR_GENERIC(TRAIT_PARA(int N, int Start), MinPrimFactor<Start>, Integ
 };
 
 
+// Tells whether dispatch_likely called the final impl or the trait
+struct LikelyProbe {
+    int operator()(TraitA &trait) {
+        trait.test2(0);
+        return 0;
+    }
+    template<class TraitImpl>
+    int operator()(TraitImpl &impl) {
+        impl.test2(1);
+        return 1;
+    }
+};
+
+// Declares a copy constructor that does not instantiate, so it opts out
+// of clone for make to compile
+struct Holder {
+    std::vector<std::unique_ptr<int>> values;
+};
+
+template<>
+struct trait::TraitClone<Holder> : std::false_type {};
+
+// Not trivially copyable, cloned without opting in
+struct Label {
+    std::string text;
+};
+
+IMPL_TRAIT_FOR_CLASS(TraitA, Label) {
+    TRAIT_FOR_CLASS_SELF;
+    void test() override {
+        std::cout<<"test for label "<<self.text<<std::endl;
+    }
+    void test2(int a) override {
+        std::cout<<"testint for label "<<a<<std::endl;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(TraitA, Holder) {
+    TRAIT_FOR_CLASS_SELF;
+    void test() override {
+        std::cout<<"test for holder "<<self.values.size()<<std::endl;
+    }
+    void test2(int a) override {
+        std::cout<<"testint for holder "<<a<<std::endl;
+    }
+};
+
+// Cloned when made directly, an owned unique_ptr<Shape> may point to a
+// Square and is not cloned
+struct Shape {
+    virtual ~Shape() = default;
+    virtual int area() {
+        return 0;
+    }
+};
+
+struct Square : public Shape {
+    int side = 3;
+    int area() override {
+        return side * side;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(TraitA, Shape) {
+    TRAIT_FOR_CLASS_SELF;
+    void test() override {
+        std::cout<<"test for shape "<<self.area()<<std::endl;
+    }
+    void test2(int a) override {
+        std::cout<<"testint for shape "<<a<<std::endl;
+    }
+};
+
+// Its constructors throw, a TraitEnum holding another type keeps it
+struct Fallible {
+    int value;
+    explicit Fallible(int value_) : value(value_) {
+        if (value < 0) {
+            throw std::runtime_error("negative");
+        }
+    }
+    Fallible(const Fallible &other) : value(other.value) {
+        throw std::runtime_error("copied");
+    }
+    Fallible(Fallible &&other) noexcept = default;
+};
+
+IMPL_TRAIT_FOR_CLASS(TraitA, Fallible) {
+    TRAIT_FOR_CLASS_SELF;
+    void test() override {
+        std::cout<<"test for fallible "<<self.value<<std::endl;
+    }
+    void test2(int a) override {
+        std::cout<<"testint for fallible "<<a<<std::endl;
+    }
+};
+
+// Neither the trait nor the type is declared in the global namespace
+// where the impl macros put __trait_impl
+namespace testscope {
+    struct Named {
+        virtual int name() = 0;
+    };
+
+    struct Thing {
+        int id;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(testscope::Named, testscope::Thing) {
+    TRAIT_FOR_CLASS_SELF;
+    int name() override {
+        return self.id;
+    }
+};
+
+// Counted by the profile test
+struct Profiled {
+    int value;
+};
+
+IMPL_TRAIT_FOR_CLASS(TraitA, Profiled) {
+    TRAIT_FOR_CLASS_SELF;
+    void test() override {
+        TRAIT_PROFILE_SCOPE;
+        std::cout<<"test for profiled "<<self.value<<std::endl;
+    }
+    void test2(int a) override {
+        TRAIT_PROFILE_SCOPE;
+        std::cout<<"testint for profiled "<<a<<std::endl;
+    }
+};
+
+// Tags need not be dense
+TRAIT_REGISTER(TraitA, Profiled, 0x80000000u);
+
+// Inherits the impl of Test3, so it shares the type_id of Test3
+struct Test3Child : public Test3 {
+    int value;
+    explicit Test3Child(int value_) : value(value_) {}
+};
+
+namespace testiter {
+    // Counts from begin up to end, the number of next calls is kept to
+    // check that take does not read ahead
+    struct Counter {
+        int begin;
+        int end;
+        int calls;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(trait::Iterator<int>, testiter::Counter) {
+    TRAIT_FOR_CLASS_SELF;
+    bool next(int &out) override {
+        self.calls++;
+        if (self.begin == self.end) {
+            return false;
+        }
+        out = self.begin++;
+        return true;
+    }
+};
+
+namespace testkey {
+    struct Id {
+        int id;
+    };
+
+    struct Name {
+        std::string name;
+    };
+
+    // Every key lands in the same slot
+    struct Collide {
+        int value;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(trait::Hash, testkey::Id) {
+    TRAIT_FOR_CLASS_SELF;
+    bool eq(trait::Eq &other) override {
+        Self *o = trait::try_cast<Self>(other);
+        return o && o->id == self.id;
+    }
+    std::size_t hash() override {
+        return std::size_t(self.id);
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(trait::Hash, testkey::Name) {
+    TRAIT_FOR_CLASS_SELF;
+    bool eq(trait::Eq &other) override {
+        Self *o = trait::try_cast<Self>(other);
+        return o && o->name == self.name;
+    }
+    std::size_t hash() override {
+        return std::hash<std::string>()(self.name);
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(trait::Hash, testkey::Collide) {
+    TRAIT_FOR_CLASS_SELF;
+    bool eq(trait::Eq &other) override {
+        Self *o = trait::try_cast<Self>(other);
+        return o && o->value == self.value;
+    }
+    std::size_t hash() override {
+        return 7;
+    }
+};
+
+
 int main() {
     std::cout<<sizeof(trait::TraitRef<TraitA>)<<std::endl;
     std::cout<<trait::is_trait<testa::Test, TraitB><<std::endl;
@@ -274,11 +558,18 @@ int main() {
     std::cout<<trait::is_trait<trait::TraitUPtr<TraitA>, TraitB><<std::endl;
     std::cout<<trait::is_trait<trait::is_trait_h<testa::Test, TraitA>::TraitImpl, TraitA><<std::endl;
     std::cout<<trait::is_trait<trait::is_trait_h<testa::Test, TraitA>::TraitImpl, TraitB><<std::endl;
+#if TRAIT_BACKEND >= 20
+    std::cout<<trait::implements<testa::Test2, TraitB, TraitA><<std::endl;
+    std::cout<<trait::implements<trait::TraitRef<TraitA>, TraitB><<std::endl;
+#endif
     auto t = testa::Test();
     (t->*(&TraitA::test))();
     (t->*(&TraitA::test2))(1);
+    int arg = 2;
+    (t->*(&TraitA::test2))(arg);
     (t->*(&TraitB::test3))();
     trait::to_trait<TraitA>(1).test();
+    std::cout<<trait::is_trait<testscope::Thing, testscope::Named><<trait::to_trait<testscope::Named>(testscope::Thing{3}).name()<<std::endl;
     {
         trait::TraitRef<TraitA> ta(t);
         ta->test();
@@ -346,6 +637,689 @@ int main() {
         trait::TraitRef<TraitB> tb3 = t3p;
         tb3->test3();
     }
+    {
+        std::cout<<"test TraitValue"<<std::endl;
+        std::cout<<trait::TraitValue<TraitA>::stores_inline<int><<std::endl;
+        std::cout<<trait::TraitValue<TraitA>::stores_inline<testa::Test><<std::endl;
+        std::vector<trait::TraitValue<TraitA>> values;
+        values.push_back(trait::own_value<TraitA>(1));
+        values.push_back(trait::make_value<TraitA, testa::Test>());
+        values.push_back(trait::own_value<TraitA>(std::make_unique<int>(1)));
+        values.push_back(trait::make_value<TraitA, Test3>());
+        for (auto &v : values) {
+            v->test();
+            trait::TraitRef<TraitA> tv = v;
+            tv->test2(3);
+            trait::to_trait<TraitB>(v).test3();
+        }
+        std::cout<<values[0].cast<int>()<<std::endl;
+        std::cout<<trait::is_trait<trait::TraitValue<TraitA>, TraitB><<std::endl;
+        auto tv = std::move(values[1]);
+        std::cout<<bool(values[1])<<std::endl;
+        tv->test();
+    }
+    {
+        std::cout<<"test arena"<<std::endl;
+        trait::MonotonicArena arena;
+        trait::PoolArena pool;
+        auto ta = trait::make_in<TraitA, testa::Test>(arena);
+        ta->test();
+        ta.reset();
+        ta = trait::own_in<TraitA>(pool, 1);
+        ta->test2(4);
+        trait::TraitRef<TraitB> tb = ta;
+        tb->test3();
+        ta = trait::own_in<TraitA>(pool, std::make_unique<int>(1));
+        ta->test();
+        ta = trait::own_in<TraitA>(arena, Test3());
+        ta->test();
+        ta.reset();
+        for (int i = 0; i < 3; i++) {
+            trait::TraitRef<TraitA> tr = trait::emplace_in<TraitA, int>(arena, i);
+            tr->test2(i);
+        }
+        char *cursor = arena.cursor;
+        try {
+            trait::make_in<TraitA, Fallible>(arena, -1);
+        } catch (std::runtime_error &e) {
+            std::cout<<e.what()<<" "<<(arena.cursor == cursor)<<std::endl;
+        }
+        try {
+            trait::emplace_in<TraitA, Fallible>(arena, -2);
+        } catch (std::runtime_error &e) {
+            std::cout<<e.what()<<" "<<(arena.cursor == cursor)<<std::endl;
+        }
+        arena.reset();
+    }
+    {
+        std::cout<<"test SharedPool"<<std::endl;
+        auto ta = trait::make_pooled<TraitA, testa::Test>();
+        ta->test();
+        std::vector<trait::TraitUPtr<TraitA>> pooled;
+        for (int i = 0; i < 100; i++) {
+            pooled.push_back(trait::own_pooled<TraitA>(i));
+        }
+        pooled.push_back(trait::own_pooled<TraitA>(std::make_unique<int>(1)));
+        pooled.back()->test();
+        std::thread([&pooled, &ta]() {
+            pooled[99]->test2(99);
+            pooled.clear();
+            ta.reset();
+            auto tb = trait::make_pooled<TraitA, Test3>();
+            tb->test();
+        }).join();
+        std::cout<<pooled.size()<<bool(ta)<<std::endl;
+        auto fallible = trait::make_pooled<TraitA, Fallible>(1);
+        void *block = fallible.get();
+        fallible.reset();
+        try {
+            trait::make_pooled<TraitA, Fallible>(-1);
+        } catch (std::runtime_error &e) {
+            fallible = trait::make_pooled<TraitA, Fallible>(2);
+            std::cout<<e.what()<<" "<<(fallible.get() == block)<<std::endl;
+        }
+    }
+    {
+        std::cout<<"test TraitArc"<<std::endl;
+        auto arc = trait::make_arc<TraitA, testa::Test>();
+        auto arc2 = arc;
+        std::cout<<arc.use_count()<<std::endl;
+        arc2->test();
+        trait::TraitRef<TraitA> tr = arc;
+        tr->test2(5);
+        trait::to_trait<TraitB>(arc).test3();
+        const trait::TraitArc<TraitA> &shared = arc2;
+        trait::TraitRef<TraitA> from_const = shared;
+        from_const->test2(6);
+        trait::to_trait<TraitB>(shared).test3();
+        auto weak = arc.downgrade();
+        arc.reset();
+        std::cout<<weak.expired()<<std::endl;
+        weak.upgrade()->test();
+        arc2.reset();
+        std::cout<<weak.expired()<<bool(weak.upgrade())<<std::endl;
+        auto rc = trait::own_rc<TraitA>(1);
+        auto rc2 = rc;
+        rc2->test();
+        std::cout<<rc.use_count()<<rc.cast<int>()<<std::endl;
+    }
+    {
+        std::cout<<"test TraitBox"<<std::endl;
+        std::cout<<sizeof(trait::TraitBox<TraitA>)<<std::endl;
+        std::vector<trait::TraitBox<TraitA>> boxes;
+        boxes.push_back(trait::make_box<TraitA, testa::Test>());
+        boxes.push_back(trait::own_box<TraitA>(1));
+        boxes.push_back(trait::own_box<TraitA>(std::make_unique<float>(2.0f)));
+        boxes.push_back(trait::make_box<TraitA, Test3>());
+        for (auto &b : boxes) {
+            b->test();
+            trait::TraitRef<TraitA> tr = b;
+            tr->test2(12);
+            trait::to_trait<TraitB>(b).test3();
+        }
+        std::cout<<boxes[1].cast<int>()<<(boxes[3].try_cast<Test3>() != nullptr)<<std::endl;
+        const trait::TraitBox<TraitA> &boxed = boxes[1];
+        trait::TraitRef<TraitA> from_const = boxed;
+        from_const->test2(13);
+        trait::to_trait<TraitB>(boxed).test3();
+        std::cout<<trait::is_trait<const trait::TraitBox<TraitA>, TraitB><<std::endl;
+        auto moved = std::move(boxes[0]);
+        std::cout<<bool(boxes[0])<<bool(moved)<<std::endl;
+        moved.reset();
+        boxes.clear();
+    }
+    {
+        std::cout<<"test TraitVec"<<std::endl;
+        trait::TraitVec<TraitA, int, Test3, std::unique_ptr<int>> tv;
+        tv.push_back(1);
+        tv.push_back(Test3());
+        tv.push_back(2);
+        tv.emplace<std::unique_ptr<int>>(new int(3));
+        std::cout<<tv.size()<<std::endl;
+        tv.for_each([](auto &impl) {
+            impl.test2(6);
+        });
+        tv[1]->test();
+        tv[2]->test();
+        trait::TraitVec<TraitA> open;
+        open.push_back(Test3());
+        open.push_back(1);
+        open.push_back(2);
+        open.for_each([](TraitA &t) {
+            t.test2(7);
+        });
+        open[0]->test();
+        open[2]->test();
+#if defined(__unix__)
+        // Past the last bucket terminates instead of reading out of bounds
+        std::cout.flush();
+        pid_t child = fork();
+        if (child == 0) {
+            close(STDERR_FILENO);
+            tv[tv.size()];
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        std::cout<<(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT)<<std::endl;
+#endif
+    }
+    {
+        std::cout<<"test Dyn"<<std::endl;
+        static_assert(std::is_trivially_copyable<trait::Dyn<TraitA>>::value, "Dyn must be trivially copyable");
+        std::cout<<sizeof(trait::Dyn<TraitA>)<<std::endl;
+        auto t3 = Test3();
+        int i = 8;
+        trait::Dyn<TraitA> dyns[] = {t, i, t3};
+        for (auto d : dyns) {
+            (d->*TRAIT_DYN_FN(&TraitA::test))();
+            (d->*TRAIT_DYN_FN(&TraitA::test2))(8);
+        }
+        std::cout<<dyns[1].cast<int>()<<std::endl;
+        const std::string word = "four";
+        std::string text = "ab";
+        trait::Dyn<const Measure> readers[] = {word, text};
+        trait::Dyn<Measure> writer = text;
+        (writer->*TRAIT_DYN_FN(&Measure::append))('c');
+        for (auto d : readers) {
+            std::cout<<(d->*TRAIT_DYN_FN(&Measure::length))();
+        }
+        std::cout<<(writer->*TRAIT_DYN_FN(&Measure::length))()<<readers[0].cast<std::string>()<<std::endl;
+        std::cout<<std::is_constructible<trait::Dyn<Measure>, const std::string&>::value
+                 <<std::is_constructible<trait::Dyn<const Measure>, const std::string&>::value<<std::endl;
+    }
+    {
+        std::cout<<"test multi-trait TraitRef"<<std::endl;
+        std::cout<<sizeof(trait::TraitRef<TraitA, TraitB>)<<std::endl;
+        trait::TraitRef<TraitA, TraitB> tab = t;
+        tab->test();
+        tab.get<TraitB>().test3();
+        trait::to_trait<TraitB>(tab).test3();
+        trait::TraitRef<TraitB> tb = tab;
+        tb->test3();
+        trait::TraitRef<TraitB, TraitA> tba = tab;
+        tba->test3();
+        auto t3 = Test3();
+        trait::TraitRef<TraitD, TraitB> tdb = t3;
+        trait::TraitRef<TraitA> ta = tdb;
+        ta->test2(9);
+        tdb.get<TraitA>().test();
+        tdb.cast<Test3>();
+    }
+    {
+        std::cout<<"test TraitEnum"<<std::endl;
+        using Enum = trait::TraitEnum<TraitA, int, Test3, std::unique_ptr<int>>;
+        std::vector<Enum> enums;
+        enums.push_back(1);
+        enums.push_back(Test3());
+        enums.push_back(std::make_unique<int>(2));
+        for (auto &e : enums) {
+            e.visit([](auto &impl) {
+                impl.test2(10);
+            });
+            (e->*(&TraitA::test))();
+            trait::TraitRef<TraitA> ta = e;
+            ta->test2(11);
+        }
+        std::cout<<enums[1].index()<<*enums[0].get_if<int>()<<(enums[0].get_if<Test3>() == nullptr)<<std::endl;
+        enums[0] = std::move(enums[1]);
+        (enums[0]->*(&TraitA::test))();
+        enums[0].emplace<int>(3);
+        enums[0].ref()->test();
+        trait::TraitEnum<TraitA, std::unique_ptr<int>, Fallible> owner = std::make_unique<int>(4);
+        try {
+            owner.emplace<Fallible>(-1);
+        } catch (std::runtime_error &e) {
+            std::cout<<e.what()<<" ";
+        }
+        std::cout<<owner.index()<<**owner.get_if<std::unique_ptr<int>>()<<std::endl;
+        using FallibleEnum = trait::TraitEnum<TraitA, int, Fallible>;
+        FallibleEnum fallible = 6;
+        FallibleEnum other = Fallible(7);
+        try {
+            fallible = other;
+        } catch (std::runtime_error &e) {
+            std::cout<<e.what()<<" ";
+        }
+        std::cout<<fallible.index()<<*fallible.get_if<int>()<<std::endl;
+        fallible = std::move(other);
+        (fallible->*(&TraitA::test))();
+    }
+    {
+        std::cout<<"test TraitRefCompact"<<std::endl;
+        std::cout<<sizeof(trait::TraitRefCompact<TraitA>)<<std::endl;
+        int i = 21;
+        auto t3 = Test3();
+        auto box = trait::make_box<TraitA, int>(22);
+        auto ptr = trait::make<TraitA, testa::Test>();
+        trait::TraitRef<TraitA> ref = t3;
+        trait::TraitRefCompact<TraitA> compact[] = {i, t3, box, ptr, ref, *ptr, {}};
+        for (auto &c : compact) {
+            if (c) {
+                c->test2(c.try_cast<int>() ? *c.try_cast<int>() : 0);
+            } else {
+                std::cout<<"empty "<<(c.type_id() == nullptr)<<std::endl;
+            }
+        }
+        trait::TraitRef<TraitA> expanded = compact[1];
+        std::cout<<(expanded.try_cast<Test3>() == &t3)<<(compact[3].type_id() == trait::type_id(ptr))<<std::endl;
+        trait::TraitRefCompact<TraitA, 3> small[] = {i, t3, i};
+        std::cout<<(small[0].bits >> 48)<<(small[1].bits >> 48)<<(small[2].type_id() == compact[0].type_id())<<std::endl;
+    }
+    {
+        std::cout<<"test try_cast"<<std::endl;
+        int i = 12;
+        auto t3 = Test3();
+        trait::TraitRef<TraitA> refs[] = {i, t3, t};
+        for (auto &r : refs) {
+            if (int *p = r.try_cast<int>()) {
+                std::cout<<"int "<<*p<<std::endl;
+            } else if (r.type_id() == trait::type_id<TraitA, Test3>()) {
+                std::cout<<"Test3 "<<(r.try_cast<Test3>() == &t3)<<std::endl;
+            } else {
+                std::cout<<"other "<<(r.try_cast<Test3>() == nullptr)<<std::endl;
+            }
+        }
+        auto ta = trait::make<TraitA, testa::Test>();
+        std::cout<<(trait::try_cast<testa::Test>(ta) != nullptr)<<(trait::try_cast<int>(ta) == nullptr)<<std::endl;
+        std::cout<<(trait::type_id(ta) == trait::type_id<TraitA, testa::Test>())<<std::endl;
+        ta.reset();
+        std::cout<<(trait::type_id(ta) == nullptr)<<std::endl;
+        auto v = trait::own_value<TraitA>(std::make_unique<int>(3));
+        std::cout<<**v.try_cast<std::unique_ptr<int>>()<<(v.try_cast<int>() == nullptr)<<std::endl;
+    }
+    {
+        std::cout<<"test dispatch_likely"<<std::endl;
+        int i = 12;
+        auto t3 = Test3();
+        trait::TraitRef<TraitA> refs[] = {i, t3, t};
+        for (auto &r : refs) {
+            int likely = trait::dispatch_likely<int, Test3>(r, LikelyProbe());
+            int unlikely = trait::dispatch_likely<Test3>(r, LikelyProbe());
+            std::cout<<likely<<unlikely<<std::endl;
+        }
+        auto p = trait::make<TraitA, testa::Test>();
+        int likely = trait::dispatch_likely<testa::Test>(p, LikelyProbe());
+        int unlikely = trait::dispatch_likely<>(*p, LikelyProbe());
+        std::cout<<likely<<unlikely<<std::endl;
+    }
+    {
+        std::cout<<"test registry"<<std::endl;
+        using Registry = trait::registry<TraitA>;
+        std::cout<<Registry::tag_of<int>()<<Registry::tag_of<Test3>()<<Registry::contains(2)<<std::endl;
+        int i = 13;
+        auto t3 = Test3();
+        std::vector<char> stream;
+        std::cout<<Registry::encode(i, stream)<<Registry::encode(t3, stream)<<Registry::encode(t, stream)<<std::endl;
+        std::cout<<Registry::tag_of(t3)<<(Registry::tag_of(t) == Registry::none)<<std::endl;
+        Registry::encode(trait::to_trait<TraitA>(14), stream);
+        std::vector<trait::TraitUPtr<TraitA>> decoded;
+        std::cout<<(Registry::decode(stream.data(), stream.size(), decoded) == stream.size())<<decoded.size()<<std::endl;
+        for (auto &d : decoded) {
+            d->test2(Registry::tag_of(*d));
+        }
+        trait::MonotonicArena arena;
+        decoded.clear();
+        std::cout<<Registry::decode_in(arena, stream.data(), stream.size() - 1, decoded)<<decoded.size()<<std::endl;
+        std::cout<<*trait::try_cast<int>(decoded[0])<<std::endl;
+        decoded.clear();
+        std::cout<<bool(Registry::make(0, stream.data(), 3))<<bool(Registry::make(7, stream.data(), 4))<<std::endl;
+        stream.clear();
+        Profiled profiled{15};
+        Registry::encode(profiled, stream);
+        std::cout<<std::hex<<Registry::tag_of(profiled)<<std::dec<<" "<<Registry::contains(0x7fffffffu)<<std::endl;
+        std::cout<<Registry::decode(stream.data(), stream.size(), decoded)<<std::endl;
+        decoded[0]->test();
+    }
+    {
+        std::cout<<"test clone"<<std::endl;
+        trait::MonotonicArena arena;
+        std::vector<trait::TraitUPtr<TraitA>> owned;
+        owned.push_back(trait::make<TraitA, testa::Test>());
+        owned.push_back(trait::own<TraitA>(5));
+        owned.push_back(trait::own<TraitA>(std::make_unique<int>(6)));
+        owned.push_back(trait::own<TraitA>(std::make_unique<float>(1.5f)));
+        owned.push_back(trait::make_pooled<TraitA, Test3Child>(7));
+        owned.push_back(trait::make_in<TraitA, int>(arena, 8));
+        owned.push_back(trait::TraitUPtr<TraitA>{nullptr, nullptr});
+        auto copy = trait::clone(owned[1]);
+        std::cout<<*trait::try_cast<int>(copy)<<bool(trait::clone(owned[3]))<<bool(trait::clone(owned[6]))<<std::endl;
+        auto child = [](trait::TraitUPtr<TraitA> &&ptr) {
+            return static_cast<Test3Child&>(trait::cast<Test3>(*ptr)).value;
+        };
+        auto all = trait::clone_all(owned);
+        for (auto &c : all) {
+            if (c) {
+                c->test();
+            } else {
+                std::cout<<"empty"<<std::endl;
+            }
+        }
+        std::cout<<*trait::try_cast<int>(all[2])<<child(std::move(all[4]))<<*trait::try_cast<int>(all[5])<<std::endl;
+        auto again = trait::clone_all(all);
+        all.clear();
+        std::cout<<child(trait::clone(again[4]))<<child(std::move(again[4]))<<std::endl;
+        again.clear();
+        auto box = trait::clone(trait::own_box<TraitA>(std::make_unique<int>(9)));
+        std::cout<<box.cast<int>()<<bool(trait::clone(trait::make_box<TraitA, std::unique_ptr<int>>()))<<std::endl;
+        auto value = trait::make_value<TraitA, Test3Child>(10);
+        auto value2 = trait::clone(value);
+        value.reset();
+        std::cout<<static_cast<Test3Child&>(value2.cast<Test3>()).value<<bool(trait::clone(trait::own_value<TraitA>(std::make_unique<int>(3))))<<std::endl;
+        auto holder = trait::make<TraitA, Holder>();
+        std::cout<<bool(trait::clone(holder))<<bool(trait::clone(trait::make_box<TraitA, Holder>()))<<std::endl;
+        auto label = trait::clone(trait::make<TraitA, Label>(Label{"label"}));
+        label->test();
+        std::cout<<trait::TraitClone<std::vector<std::unique_ptr<int>>>::value<<trait::TraitClone<std::vector<Label>>::value<<std::endl;
+        auto shape = trait::clone(trait::make<TraitA, Shape>());
+        std::cout<<bool(shape)<<bool(trait::clone(trait::own<TraitA>(std::unique_ptr<Shape>(new Square()))))<<std::endl;
+        std::cout<<bool(trait::clone(trait::own_pooled<TraitA>(std::unique_ptr<Shape>(new Square()))))
+                 <<bool(trait::clone(trait::own_in<TraitA>(arena, std::unique_ptr<Shape>(new Square()))))
+                 <<bool(trait::clone(trait::own_box<TraitA>(std::unique_ptr<Shape>(new Square()))))<<std::endl;
+    }
+    {
+        std::cout<<"test parallel_for_each"<<std::endl;
+        trait::ThreadPool pool(3);
+        std::vector<trait::TraitUPtr<TraitA>> owned;
+        for (int i = 0; i < 1000; i++) {
+            owned.push_back(i % 100 < 90 ? trait::make<TraitA, int>(i) : trait::make<TraitA, Test3>());
+        }
+        std::atomic<long> sum{0};
+        std::atomic<int> others{0};
+        auto count = [&](TraitA &trait) {
+            if (int *p = trait::try_cast<int>(trait)) {
+                sum += *p;
+            } else {
+                others++;
+            }
+        };
+        trait::parallel_for_each(pool, owned, count);
+        std::cout<<sum<<" "<<others<<std::endl;
+        std::vector<trait::TraitRef<TraitA>> refs(owned.begin(), owned.end());
+        sum = 0;
+        others = 0;
+        trait::parallel_for_each(refs, count);
+        std::cout<<sum<<" "<<others<<std::endl;
+        std::vector<int> ints(5000, 2);
+        sum = 0;
+        trait::parallel_for_each<TraitA>(pool, ints, [&](auto &impl) {
+            sum += impl.self;
+        });
+        std::cout<<sum<<std::endl;
+        trait::TraitVec<TraitA, int, Test3> tv;
+        for (int i = 0; i < 300; i++) {
+            tv.push_back(i);
+            tv.push_back(Test3());
+        }
+        sum = 0;
+        others = 0;
+        trait::parallel_for_each(pool, tv, count);
+        std::cout<<sum<<" "<<others<<std::endl;
+        try {
+            trait::parallel_for_each(pool, owned, [](TraitA &trait) {
+                if (trait::try_cast<int>(trait) && *trait::try_cast<int>(trait) == 500) {
+                    throw 500;
+                }
+            });
+        } catch (int e) {
+            std::cout<<"caught "<<e<<std::endl;
+        }
+    }
+    {
+        std::cout<<"test channel"<<std::endl;
+        trait::spsc_channel<TraitA> spsc(3);
+        std::cout<<spsc.capacity()<<spsc.try_push(trait::make<TraitA, int>(1))<<spsc.try_emplace<int>(2);
+        std::cout<<spsc.try_emplace<Test3>()<<spsc.try_push(trait::make<TraitA, int>(4))<<spsc.try_emplace<int>(5)<<std::endl;
+        trait::TraitUPtr<TraitA> item{nullptr, nullptr};
+        std::vector<trait::TraitUPtr<TraitA>> items;
+        spsc.pop(item);
+        std::cout<<*trait::try_cast<int>(item)<<spsc.try_pop_n(items, 8)<<*trait::try_cast<int>(items[0]);
+        // The slots of 2 and Test3 are loaned until the objects are dropped
+        std::cout<<spsc.try_emplace<int>(6)<<spsc.try_emplace<int>(7)<<spsc.try_emplace<int>(8)<<std::endl;
+        items.clear();
+        std::cout<<spsc.try_emplace<int>(8)<<spsc.try_emplace<int>(9)<<std::endl;
+        spsc.close();
+        int sum = 0;
+        while (spsc.pop(item)) {
+            sum += *trait::try_cast<int>(item);
+        }
+        std::cout<<sum<<std::endl;
+        trait::spsc_channel<TraitA, 8> small(2);
+        small.emplace<int>(10);
+        std::cout<<small.pop(item)<<*trait::try_cast<int>(item)<<std::endl;
+        // An object emplaced in source and moved through forward goes back
+        // to source, forward gets its slot back when it is popped
+        trait::spsc_channel<TraitA> source(2);
+        trait::spsc_channel<TraitA> forward(2);
+        source.emplace<int>(11);
+        source.pop(item);
+        std::cout<<forward.try_push(std::move(item))<<forward.pop(item)<<*trait::try_cast<int>(item);
+        std::cout<<forward.try_push(trait::make<TraitA, int>(12))<<forward.try_push(trait::make<TraitA, int>(13));
+        item.reset();
+        std::cout<<source.try_emplace<int>(14)<<source.try_emplace<int>(15)<<std::endl;
+
+        trait::mpsc_channel<TraitA> mpsc(64);
+        std::vector<std::thread> producers;
+        for (int p = 0; p < 3; p++) {
+            producers.emplace_back([&mpsc, p] {
+                std::vector<trait::TraitUPtr<TraitA>> batch;
+                for (int i = 0; i < 1000; i++) {
+                    if (i % 3 == 0) {
+                        mpsc.push(trait::make<TraitA, int>(p * 1000 + i));
+                    } else if (i % 3 == 1) {
+                        mpsc.emplace<int>(p * 1000 + i);
+                    } else {
+                        batch.push_back(trait::make<TraitA, int>(p * 1000 + i));
+                    }
+                    if (batch.size() == 16) {
+                        mpsc.push_n(batch.begin(), batch.size());
+                        batch.clear();
+                    }
+                }
+                mpsc.push_n(batch.begin(), batch.size());
+            });
+        }
+        std::thread closer([&] {
+            for (auto &producer : producers) {
+                producer.join();
+            }
+            mpsc.close();
+        });
+        long total = 0;
+        std::size_t count = 0;
+        while (mpsc.pop_n(items, 32)) {
+            for (auto &i : items) {
+                total += *trait::try_cast<int>(i);
+            }
+            count += items.size();
+            items.clear();
+        }
+        closer.join();
+        std::cout<<count<<" "<<total<<std::endl;
+    }
+    {
+        std::cout<<"test iter"<<std::endl;
+        testiter::Counter counter{0, 100, 0};
+        auto square = [](int x) {
+            return x * x;
+        };
+        auto odd = [](int x) {
+            return x % 2 == 1;
+        };
+        auto add = [](long acc, int x) {
+            return acc + x;
+        };
+        std::cout<<trait::iter<int>(counter).map(square).filter(odd).take(3).fold(0L, add)<<" "<<counter.begin<<std::endl;
+        std::cout<<trait::iter<int>(counter).fold(0L, add)<<" "<<counter.calls<<std::endl;
+        testiter::Counter dynamic{0, 100, 0};
+        trait::TraitRef<trait::Iterator<int>> ref(dynamic);
+        std::cout<<trait::iter<int>(ref).filter(odd).take(5).map(square).fold(0L, add)<<" "<<dynamic.begin<<std::endl;
+        std::cout<<trait::iter<int>(ref).take(10).fold(0L, add)<<" "<<dynamic.begin<<std::endl;
+        auto owned = trait::make<trait::Iterator<int>, testiter::Counter>(testiter::Counter{10, 200, 0});
+        std::cout<<trait::iter<int>(owned).fold(0L, add)<<" "<<trait::try_cast<testiter::Counter>(owned)->calls<<std::endl;
+        int chunk[8];
+        testiter::Counter direct{0, 5, 0};
+        trait::TraitRef<trait::Iterator<int>> direct_ref(direct);
+        trait::Iterator<int> &base = *direct_ref;
+        std::cout<<base.next_chunk(chunk, 8)<<chunk[4]<<base.next_chunk(chunk, 8)<<trait::iter<int>(base).fold(0L, add)<<std::endl;
+    }
+    {
+        std::cout<<"test TraitHashMap"<<std::endl;
+        trait::TraitHashMap<trait::Hash, int> map;
+        auto inserted = map.emplace(trait::make<trait::Hash, testkey::Id>(1), 10);
+        std::cout<<inserted.second<<*inserted.first<<map.emplace(trait::make<trait::Hash, testkey::Name>("a"), 20).second;
+        auto duplicate = trait::make<trait::Hash, testkey::Id>(1);
+        inserted = map.emplace(std::move(duplicate), 30);
+        std::cout<<inserted.second<<*inserted.first<<bool(duplicate)<<map.size()<<std::endl;
+        testkey::Id id{1};
+        testkey::Name name{"a"};
+        testkey::Name missing{"b"};
+        trait::TraitRef<trait::Hash> ref(name);
+        std::cout<<*map.find(id)<<*map.find(ref)<<(map.find(missing) == nullptr)<<(map.find(testkey::Id{2}) == nullptr)<<std::endl;
+        for (int i = 0; i < 1000; i++) {
+            map.emplace(trait::make<trait::Hash, testkey::Id>(i + 2), i);
+            map.emplace(trait::make<trait::Hash, testkey::Collide>(i), -i);
+        }
+        bool found = true;
+        for (int i = 0; i < 1000; i += 2) {
+            found = found && map.erase(testkey::Collide{i}) && map.erase(testkey::Id{i + 2});
+        }
+        for (int i = 0; i < 1000; i++) {
+            int *v = map.find(testkey::Collide{i});
+            int *w = map.find(testkey::Id{i + 2});
+            found = found && (i % 2 ? v && *v == -i && w && *w == i : !v && !w);
+        }
+        auto owned = trait::make<trait::Hash, testkey::Collide>(999);
+        std::cout<<found<<map.size()<<map.erase(owned)<<map.erase(owned)<<map.size()<<std::endl;
+        trait::TraitHashMap<trait::Hash, int> moved(std::move(map));
+        long sum = 0;
+        moved.for_each([&](trait::Hash &key, int &value) {
+            if (trait::try_cast<testkey::Name>(key)) {
+                value = 1000;
+            }
+            sum += value;
+        });
+        std::cout<<sum<<map.size()<<moved.size()<<*moved.find(name)<<std::endl;
+        map = std::move(moved);
+        map.clear();
+        std::cout<<map.size()<<map.contains(id)<<std::endl;
+    }
+#if defined(__unix__)
+    {
+        std::cout<<"test mapped"<<std::endl;
+        char path[64];
+        std::snprintf(path, sizeof(path), "/dev/shm/rust_trait_test_%d", int(getpid()));
+        const std::size_t size = 4096;
+        std::cout.flush();
+        pid_t producer = fork();
+        if (producer == 0) {
+            int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0 || ftruncate(fd, size) != 0) {
+                _exit(1);
+            }
+            void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            char *cursor = static_cast<char*>(memory);
+            trait::emplace_mapped<TraitA, int>(cursor, 21);
+            cursor += trait::mapped_size<TraitA, int>();
+            trait::emplace_mapped<TraitA, Test3>(cursor);
+            cursor += trait::mapped_size<TraitA, Test3>();
+            trait::emplace_mapped<TraitA, int>(cursor, 22);
+            munmap(memory, size);
+            close(fd);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(producer, &status, 0);
+        std::cout<<(WIFEXITED(status) && WEXITSTATUS(status) == 0)<<std::endl;
+        int fd = open(path, O_RDONLY);
+        unlink(path);
+        void *first = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        void *second = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        for (void *memory : {first, second}) {
+            auto *record = static_cast<trait::TraitMapped<TraitA>*>(memory);
+            for (int i = 0; i < 3; i++, record = record->next()) {
+                trait::TraitRef<TraitA> r = record->get();
+                r->test2(record->tag);
+                int *p = record->try_cast<int>();
+                std::cout<<record->valid()<<(p ? *p : -1)<<(r.try_cast<Test3>() != nullptr)<<std::endl;
+            }
+            std::cout<<record->valid()<<(record->next() == nullptr)<<std::endl;
+        }
+        munmap(first, size);
+        munmap(second, size);
+    }
+#endif
+#if TRAIT_PROFILE
+    {
+        std::cout<<"test profile"<<std::endl;
+        trait::profile_reset();
+        Profiled profiled{2};
+        trait::TraitRef<TraitA> r = profiled;
+        r->test();
+        r->test2(1);
+        std::thread([]() {
+            auto p = trait::make<TraitA, Profiled>(3);
+            p->test2(3);
+        }).join();
+        auto p = trait::make<TraitA, Profiled>(4);
+        for (auto &entry : trait::profile_snapshot()) {
+            std::cout<<entry.trait<<" "<<entry.base<<" "<<entry.method<<" "<<entry.calls<<" "
+                     <<entry.allocations<<" "<<entry.frees<<std::endl;
+        }
+        trait::profile_reset();
+        p->test();
+        trait::profile_dump(std::cout);
+    }
+#endif
+#if TRAIT_COROUTINES
+    {
+        std::cout<<"test async trait"<<std::endl;
+        int i = 5;
+        auto t3 = Test3();
+        trait::TraitRef<AsyncRead> r1 = i;
+        trait::TraitRef<AsyncRead> r2 = t3;
+        auto owned = trait::make<AsyncRead, Test3>();
+        std::cout<<executor.block_on(r1->read(2))<<std::endl;
+        std::cout<<executor.block_on(r2->read(3))<<std::endl;
+        int sum = 0;
+        auto caller = [&](trait::TraitRef<AsyncRead> r, int key) -> trait::Task<void> {
+            sum += co_await r->read(key);
+        };
+        for (int k = 0; k < 4; k++) {
+            executor.spawn(caller(k % 2 ? r1 : r2, k));
+        }
+        executor.spawn(caller(owned, 9));
+        executor.run();
+        std::cout<<sum<<std::endl;
+        trait::FramePool pool;
+        std::cout<<executor.block_on(owned->read_in(pool, 4))<<std::endl;
+        try {
+            executor.block_on(owned->read_in(pool, -1));
+        } catch (int e) {
+            std::cout<<"caught "<<e<<std::endl;
+        }
+        auto outside = []() -> trait::Task<int> {
+            co_await std::suspend_always();
+            co_return 1;
+        };
+        try {
+            outside().get();
+        } catch (std::logic_error &e) {
+            std::cout<<e.what()<<std::endl;
+        }
+        try {
+            executor.block_on(outside());
+        } catch (std::logic_error &e) {
+            std::cout<<e.what()<<std::endl;
+        }
+        std::size_t recycled = 0;
+        for (std::size_t count : pool.counts) {
+            recycled += count;
+        }
+        std::cout<<recycled<<std::endl;
+    }
+#endif
     std::cout<<trait::is_trait<ZFCIntGen<12>::IntType, Odd><<std::endl;
     std::cout<<trait::is_trait<ZFCIntGen<13>::IntType, Odd><<std::endl;
     std::cout<<trait::is_trait<ZFCIntGen<14>::IntType, Even><<std::endl;
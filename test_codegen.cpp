@@ -0,0 +1,195 @@
+// Call sites checked by test_codegen.py. The prefix of every function tells
+// what its optimized code may contain:
+//   codegen_inline_*   fully inlined: no call, no vtable reference, no allocation
+//   codegen_static_*   no indirect call, no load from a vtable, no allocation
+//   codegen_direct_*   no indirect call, no allocation
+//   codegen_noalloc_*  no allocation
+#include <memory>
+#include "rust_trait.h"
+
+
+struct Value {
+    virtual int value() = 0;
+    virtual int add(int a) = 0;
+};
+
+struct Doubled {
+    virtual int doubled() = 0;
+};
+
+namespace codegen {
+    struct Square {
+        int side;
+    };
+
+    struct Line {
+        int len;
+    };
+
+    struct Range {
+        int begin;
+        int end;
+    };
+
+    struct Id {
+        int id;
+    };
+}
+
+IMPL_TRAIT_FOR_CLASS(Value, codegen::Square) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        TRAIT_PROFILE_SCOPE;
+        return self.side * self.side;
+    }
+    int add(int a) override {
+        return self.side + a;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(Value, codegen::Line) {
+    TRAIT_FOR_CLASS_SELF;
+    int value() override {
+        return self.len;
+    }
+    int add(int a) override {
+        return self.len - a;
+    }
+};
+
+IMPL_TRAIT_FOR_TRAIT(Doubled, Value) {
+    TRAIT_FOR_TRAIT_SELF(Doubled);
+    int doubled() override {
+        return trait::to_trait<Value>(self).value() * 2;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(trait::Iterator<int>, codegen::Range) {
+    TRAIT_FOR_CLASS_SELF;
+    bool next(int &out) override {
+        if (self.begin == self.end) {
+            return false;
+        }
+        out = self.begin++;
+        return true;
+    }
+};
+
+IMPL_TRAIT_FOR_CLASS(trait::Hash, codegen::Id) {
+    TRAIT_FOR_CLASS_SELF;
+    bool eq(trait::Eq &other) override {
+        Self *o = trait::try_cast<Self>(other);
+        return o && o->id == self.id;
+    }
+    std::size_t hash() override {
+        return std::size_t(self.id);
+    }
+};
+
+// Returns -1 when dispatch_likely falls back to the virtual call
+struct LikelyValue {
+    int operator()(Value &) {
+        return -1;
+    }
+    template<class TraitImpl>
+    int operator()(TraitImpl &impl) {
+        return impl.value();
+    }
+};
+
+extern "C" {
+
+int codegen_inline_to_trait(codegen::Square &s) {
+    return trait::to_trait<Value>(s).value();
+}
+
+int codegen_inline_to_trait_args(codegen::Square &s, int a) {
+    return trait::to_trait<Value>(s).add(a);
+}
+
+int codegen_inline_to_trait_rvalue(int side) {
+    return trait::to_trait<Value>(codegen::Square{side}).value();
+}
+
+int codegen_inline_blanket_impl(codegen::Line &l) {
+    return trait::to_trait<Doubled>(l).doubled();
+}
+
+int codegen_inline_trait_impl_static(codegen::Square &s) {
+    trait::is_trait_h<codegen::Square, Value>::TraitImpl impl{s};
+    return impl.add(impl.value());
+}
+
+int codegen_inline_traitenum_visit(trait::TraitEnum<Value, codegen::Square, codegen::Line> &e) {
+    return e.visit([](auto &impl) {
+        return impl.value();
+    });
+}
+
+int codegen_inline_traitvec_for_each(trait::TraitVec<Value, codegen::Square, codegen::Line> &v) {
+    int sum = 0;
+    v.for_each([&sum](auto &impl) {
+        sum += impl.value();
+    });
+    return sum;
+}
+
+int codegen_inline_iter_fold(codegen::Range &r) {
+    return trait::iter<int>(r).map([](int x) {
+        return x * 3;
+    }).filter([](int x) {
+        return x % 2 == 0;
+    }).take(100).fold(0, [](int acc, int x) {
+        return acc + x;
+    });
+}
+
+int codegen_direct_iter_next_chunk(codegen::Range &r, int *out) {
+    return static_cast<int>(trait::to_trait<trait::Iterator<int>>(r).next_chunk(out, 16));
+}
+
+int codegen_direct_hashmap_find_base(trait::TraitHashMap<trait::Hash, int> &map, codegen::Id &id) {
+    int *value = map.find(id);
+    return value ? *value : -1;
+}
+
+int codegen_static_operator_arrow_star(codegen::Square &s) {
+    return (s->*(&Value::value))();
+}
+
+int codegen_static_operator_arrow_star_args(codegen::Square &s, int a) {
+    return (s->*(&Value::add))(a);
+}
+
+int codegen_static_traitenum_arrow_star(trait::TraitEnum<Value, codegen::Square, codegen::Line> &e, int a) {
+    return (e->*(&Value::add))(a);
+}
+
+int codegen_direct_try_cast(trait::TraitRef<Value> &ref) {
+    codegen::Square *s = ref.try_cast<codegen::Square>();
+    return s ? s->side : 0;
+}
+
+int codegen_direct_type_id(trait::TraitRef<Value> &ref) {
+    return ref.type_id() == trait::type_id<Value, codegen::Line>();
+}
+
+int codegen_direct_dispatch_likely(trait::TraitRef<Value> &ref) {
+    return trait::dispatch_likely<codegen::Square, codegen::Line>(ref, LikelyValue());
+}
+
+int codegen_noalloc_traitref(codegen::Square &s) {
+    trait::TraitRef<Value> ref = s;
+    return ref->value();
+}
+
+int codegen_noalloc_traitref_compact(trait::TraitRefCompact<Value> &ref) {
+    return ref->value();
+}
+
+int codegen_noalloc_make_value(int side) {
+    auto v = trait::make_value<Value, codegen::Square>(side);
+    return v->value();
+}
+
+}
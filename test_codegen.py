@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""Codegen regression test for the static dispatch paths.
+
+Compiles test_codegen.cpp to assembly at -O2 with every available compiler
+and checks each codegen_* function against the rules named by its prefix
+(see test_codegen.cpp). Exits with a non-zero status when any rule is broken:
+
+    python3 test_codegen.py
+    CXX=g++ python3 test_codegen.py
+
+Supports x86-64 and AArch64 assembly.
+"""
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(ROOT, 'test_codegen.cpp')
+FLAGS = ['-std=c++14', '-O2', '-S', '-fno-asynchronous-unwind-tables', '-fno-stack-protector']
+
+CALL = re.compile(r'^\s*(call|bl|blr)\b')
+# Indirect calls and indirect tail calls through memory or a register.
+# Jump tables of switch statements are the only indirect jumps allowed
+INDIRECT_CALL = re.compile(r'^\s*(call[q]?\s+\*|notrack\s+call[q]?\s+\*|jmp[q]?\s+\*-?\d*\(%|blr\b)')
+VTABLE = re.compile(r'_ZTV')
+# Reads from a vtable. Taking its address to build a trait object is fine
+VTABLE_LOAD = re.compile(r'^\s*(?!lea[lq]?\b|adrp\b|add\b)\S+\s.*(?<!\$)\b(\d+\+)?_ZTV')
+ALLOCATION = re.compile(r'\b(_Znw[mj]|_Zna[mj]|_ZnwmSt|malloc|calloc|realloc)\b')
+
+RULES = {
+    'codegen_inline_': [('call', CALL), ('indirect call', INDIRECT_CALL),
+                        ('vtable reference', VTABLE), ('heap allocation', ALLOCATION)],
+    'codegen_static_': [('indirect call', INDIRECT_CALL), ('vtable load', VTABLE_LOAD),
+                        ('heap allocation', ALLOCATION)],
+    'codegen_direct_': [('indirect call', INDIRECT_CALL), ('heap allocation', ALLOCATION)],
+    'codegen_noalloc_': [('heap allocation', ALLOCATION)],
+}
+
+
+def functions(asm):
+    """Maps every codegen_* function to its instruction lines."""
+    result = {}
+    current = None
+    for line in asm.splitlines():
+        label = re.match(r'^(codegen_\w+):', line)
+        if label:
+            current = label.group(1)
+            result[current] = []
+            continue
+        if current is None:
+            continue
+        if re.match(r'^\s*\.(size|cfi_endproc)\b', line) or re.match(r'^[A-Za-z_$][\w$.]*:', line):
+            current = None
+            continue
+        stripped = line.strip()
+        if stripped and not stripped.startswith('.') and not stripped.endswith(':'):
+            result[current].append(line)
+    return result
+
+
+def check(compiler, workdir):
+    output = os.path.join(workdir, os.path.basename(compiler) + '.s')
+    cmd = [compiler] + FLAGS + ['-I', ROOT, SOURCE, '-o', output]
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if proc.returncode != 0:
+        print('FAIL %s: compile error\n%s' % (compiler, proc.stdout.decode(errors='replace')))
+        return False
+    with open(output) as f:
+        found = functions(f.read())
+    expected = re.findall(r'^int (codegen_\w+)\(', open(SOURCE).read(), re.M)
+    ok = True
+    for name in expected:
+        if name not in found:
+            print('FAIL %s: %s not found in assembly' % (compiler, name))
+            ok = False
+            continue
+        rules = next(rules for prefix, rules in RULES.items() if name.startswith(prefix))
+        broken = [(what, line.strip()) for what, pattern in rules
+                  for line in found[name] if pattern.search(line)]
+        if broken:
+            ok = False
+            print('FAIL %s: %s' % (compiler, name))
+            for what, line in broken:
+                print('    %s: %s' % (what, line))
+        else:
+            print('ok   %s: %s' % (compiler, name))
+    return ok
+
+
+def main():
+    compilers = os.environ.get('CXX', 'g++ clang++').split()
+    compilers = [c for c in compilers if shutil.which(c)]
+    if not compilers:
+        print('no compiler found')
+        return 1
+    workdir = tempfile.mkdtemp(prefix='trait_codegen_')
+    try:
+        results = [check(compiler, workdir) for compiler in compilers]
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+    return 0 if all(results) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())